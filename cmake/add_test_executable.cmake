@@ -5,20 +5,95 @@ function(add_test_executable_gc TARGET_NAME SOURCE_FILE)
         # print debug info
 
         COMMAND echo Current source directory: ${CMAKE_CURRENT_SOURCE_DIR}
-        COMMAND echo "${CMAKE_CURRENT_BINARY_DIR}/eva-llvm ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.ll"
-
-        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.ll
-        # TODO: get rid of hardcoded path
-        COMMAND clang
-            ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.ll
-            /usr/lib/x86_64-linux-gnu/libgc.so
-            -o ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}
+        COMMAND echo "${CMAKE_CURRENT_BINARY_DIR}/eva-llvm ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}"
+
+        # the compiler emits the object file and links it against libgc itself
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}
         COMMAND ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME} > ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.txt
         COMMAND diff ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.txt ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TARGET_NAME}.txt
         # set working directory as project root
         WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
         DEPENDS ${SOURCE_FILE}
         DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TARGET_NAME}.txt
+        DEPENDS eva-llvm
         COMMENT "Building and testing ${TARGET_NAME}"
     )
 endfunction()
+
+function(add_test_jit TEST_NAME SOURCE_FILE)
+    # optional run mode, e.g. "lazy" for --run=lazy
+    if (ARGC GREATER 2)
+        set(RUN_FLAG --run=${ARGV2})
+        set(JIT_NAME ${TEST_NAME}_jit_${ARGV2})
+    else()
+        set(RUN_FLAG --run)
+        set(JIT_NAME ${TEST_NAME}_jit)
+    endif()
+
+    add_custom_target(${JIT_NAME} ALL
+        # run in-process with the JIT, the output must match the executable's
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm ${RUN_FLAG} ${SOURCE_FILE} > ${CMAKE_CURRENT_BINARY_DIR}/${JIT_NAME}.txt
+        COMMAND diff ${CMAKE_CURRENT_BINARY_DIR}/${JIT_NAME}.txt ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TEST_NAME}.txt
+        # set working directory as project root
+        WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+        DEPENDS ${SOURCE_FILE}
+        DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TEST_NAME}.txt
+        DEPENDS eva-llvm
+        COMMENT "Running ${TEST_NAME} with the JIT (${RUN_FLAG})"
+    )
+endfunction()
+
+function(add_test_repl TARGET_NAME SOURCE_FILE)
+    add_custom_target(${TARGET_NAME} ALL
+        # feed the source to the REPL line by line, prompts are in the output
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm --repl < ${SOURCE_FILE} > ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.txt
+        COMMAND diff ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.txt ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TARGET_NAME}.txt
+        # set working directory as project root
+        WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+        DEPENDS ${SOURCE_FILE}
+        DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TARGET_NAME}.txt
+        DEPENDS eva-llvm
+        COMMENT "Running ${TARGET_NAME} in the REPL"
+    )
+endfunction()
+
+function(add_test_parallel TEST_NAME SOURCE_FILE JOBS)
+    set(PARALLEL_NAME ${TEST_NAME}_j${JOBS})
+    add_custom_target(${PARALLEL_NAME} ALL
+        # the partitions are emitted as separate objects and linked together
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm -j${JOBS} ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${PARALLEL_NAME}
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/${PARALLEL_NAME} > ${CMAKE_CURRENT_BINARY_DIR}/${PARALLEL_NAME}.txt
+        COMMAND diff ${CMAKE_CURRENT_BINARY_DIR}/${PARALLEL_NAME}.txt ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TEST_NAME}.txt
+        # set working directory as project root
+        WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+        DEPENDS ${SOURCE_FILE}
+        DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/src/test/expected/${TEST_NAME}.txt
+        DEPENDS eva-llvm
+        COMMENT "Building ${TEST_NAME} in ${JOBS} partitions"
+    )
+endfunction()
+
+function(add_test_ir TARGET_NAME SOURCE_FILE FUNCTION MATCH)
+    # optional regex no line of the function may match
+    if (ARGC GREATER 4)
+        set(REJECT ${ARGV4})
+    endif()
+
+    add_custom_target(${TARGET_NAME} ALL
+        # the optimization shows in the IR, the output is the same without it
+        COMMAND ${CMAKE_CURRENT_BINARY_DIR}/eva-llvm --emit=ll ${SOURCE_FILE} ${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.ll
+        COMMAND ${CMAKE_COMMAND}
+            -DIR_FILE=${CMAKE_CURRENT_BINARY_DIR}/${TARGET_NAME}.ll
+            -DFUNCTION=${FUNCTION}
+            -DMATCH=${MATCH}
+            -DREJECT=${REJECT}
+            -P ${CMAKE_CURRENT_SOURCE_DIR}/cmake/check_ir.cmake
+        # set working directory as project root
+        WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+        DEPENDS ${SOURCE_FILE}
+        DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/cmake/check_ir.cmake
+        DEPENDS eva-llvm
+        COMMENT "Checking the IR of ${FUNCTION} in ${SOURCE_FILE}"
+        VERBATIM
+    )
+endfunction()
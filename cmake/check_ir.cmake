@@ -0,0 +1,33 @@
+# Checks the body of FUNCTION in the IR file IR_FILE: it must contain a line
+# matching the MATCH regex and no line matching REJECT, when they're given.
+file(STRINGS ${IR_FILE} lines)
+
+set(body "")
+set(inside FALSE)
+foreach (line IN LISTS lines)
+    if (NOT inside AND line MATCHES "^define .*@${FUNCTION}[(]")
+        set(inside TRUE)
+    elseif (inside AND line MATCHES "^}")
+        break()
+    elseif (inside)
+        list(APPEND body "${line}")
+    endif()
+endforeach()
+
+if (NOT inside)
+    message(FATAL_ERROR "${IR_FILE}: no definition of @${FUNCTION}")
+endif()
+
+set(matched FALSE)
+foreach (line IN LISTS body)
+    if (MATCH AND line MATCHES "${MATCH}")
+        set(matched TRUE)
+    endif()
+    if (REJECT AND line MATCHES "${REJECT}")
+        message(FATAL_ERROR "${IR_FILE}: @${FUNCTION} has \"${line}\"")
+    endif()
+endforeach()
+
+if (MATCH AND NOT matched)
+    message(FATAL_ERROR "${IR_FILE}: @${FUNCTION} has no \"${MATCH}\"")
+endif()
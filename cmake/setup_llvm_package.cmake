@@ -5,4 +5,11 @@ function(setup_llvm_package)
     include_directories(${LLVM_INCLUDE_DIRS})
     message(STATUS "Found LLVM ${LLVM_PACKAGE_VERSION}")
     message(STATUS "Using LLVMConfig.cmake in: ${LLVM_DIR}")
+
+    # libraries for the optimizer, the bitcode, the JIT and the host code
+    # generator
+    llvm_map_components_to_libnames(llvm_libs
+        Passes BitReader BitWriter Linker OrcJIT nativecodegen
+    )
+    set(EVA_LLVM_LIBS ${llvm_libs} PARENT_SCOPE)
 endfunction()
@@ -0,0 +1,32 @@
+# Writes the version of the compiler to OUTPUT as EVA_VERSION, it keys the
+# compiled outputs cache. It's the git commit of SOURCE_DIR, with the hash of
+# the local changes if there are any, unless EVA_VERSION is given. It runs on
+# every build and the header only changes with the version, so a rebuilt
+# compiler never picks up the stale cache entries.
+if (NOT EVA_VERSION)
+    execute_process(
+        COMMAND git describe --always --dirty --abbrev=40
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_VARIABLE EVA_VERSION
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        RESULT_VARIABLE result
+        ERROR_QUIET
+    )
+    if (NOT result EQUAL 0 OR EVA_VERSION STREQUAL "")
+        set(EVA_VERSION "unknown")
+    elseif (EVA_VERSION MATCHES "-dirty$")
+        execute_process(
+            COMMAND git diff HEAD
+            WORKING_DIRECTORY ${SOURCE_DIR}
+            OUTPUT_VARIABLE diff
+            ERROR_QUIET
+        )
+        string(SHA1 diffHash "${diff}")
+        set(EVA_VERSION "${EVA_VERSION}-${diffHash}")
+    endif()
+endif()
+
+file(WRITE ${OUTPUT}.tmp "#define EVA_VERSION \"${EVA_VERSION}\"\n")
+execute_process(
+    COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT}
+)
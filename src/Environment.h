@@ -1,8 +1,10 @@
 #ifndef Envinroment_h
 #define Envinroment_h
 
-#include "EvaLLVM.h" // for dumpValueToString, dprintf
+#include "EvaLLVM.h" // for dumpValueToString
+#include "Trace.h"
 #include "TypesMisc.h"
+#include <atomic>
 #include <map>
 #include <string>
 
@@ -42,7 +44,8 @@ class Environment : public std::enable_shared_from_this<Environment> {
             }
         }
         record_[name] = {value, typeForPtr};
-        dprintf(
+        EVA_TRACE(
+            TRACE_ENV,
             "Env var defined: name %s, value %s, type %s\n",
             name.c_str(),
             dumpValueToString(value).c_str(),
@@ -55,13 +58,20 @@ class Environment : public std::enable_shared_from_this<Environment> {
      * Get the value of a variable with a given name
      */
     llvm::Value* lookup_value(const std::string& name) {
+        lookups.fetch_add(1, std::memory_order_relaxed);
         return resolve(name)->record_[name].value;
     }
 
     ValueType lookup(const std::string& name) {
+        lookups.fetch_add(1, std::memory_order_relaxed);
         return resolve(name)->record_[name];
     }
 
+    /**
+     * Number of the lookups in all the environments, for the statistics
+     */
+    static inline std::atomic<uint64_t> lookups = 0;
+
     /**
      * Dump
      */
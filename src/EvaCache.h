@@ -0,0 +1,131 @@
+#ifndef EvaCache_h
+#define EvaCache_h
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+#include <initializer_list>
+#include <string>
+
+/**
+ * Content-addressed cache of the compiled outputs: a file is stored under the
+ * hash of everything it's built from.
+ */
+class EvaCache : public llvm::ObjectCache {
+  public:
+    explicit EvaCache(const std::string& dir) : dir_(dir) {
+        llvm::sys::fs::create_directories(dir_);
+    }
+
+    /**
+     * Hash the parts of the key, the parts are length-prefixed so they can't
+     * run into each other
+     */
+    static std::string makeKey(std::initializer_list<llvm::StringRef> parts) {
+        llvm::SHA1 sha1;
+        for (const auto& part : parts) {
+            sha1.update(std::to_string(part.size()) + ":");
+            sha1.update(part);
+        }
+        return llvm::toHex(sha1.final(), /* LowerCase */ true);
+    }
+
+    /**
+     * Path of a cache entry
+     */
+    std::string getPath(const std::string& key) const {
+        llvm::SmallString<128> path(dir_);
+        llvm::sys::path::append(path, key);
+        return std::string(path);
+    }
+
+    /**
+     * Copy the cache entry to the file, false if there is no entry
+     */
+    bool load(const std::string& key, const std::string& fileName) const {
+        const auto path = getPath(key);
+        if (!llvm::sys::fs::exists(path)) {
+            return false;
+        }
+        if (llvm::sys::fs::copy_file(path, fileName)) {
+            return false;
+        }
+        // keep the executables runnable
+        if (auto perms = llvm::sys::fs::getPermissions(path)) {
+            llvm::sys::fs::setPermissions(fileName, *perms);
+        }
+        return true;
+    }
+
+    /**
+     * Store a copy of the file
+     */
+    void store(const std::string& key, const std::string& fileName) const {
+        auto buffer = llvm::MemoryBuffer::getFile(fileName);
+        auto perms = llvm::sys::fs::getPermissions(fileName);
+        if (buffer && perms) {
+            storeBuffer(key, (*buffer)->getBuffer(), *perms);
+        }
+    }
+
+    /**
+     * JIT: the module identifier is the cache key of its object
+     */
+    void notifyObjectCompiled(
+        const llvm::Module* module, llvm::MemoryBufferRef obj) override {
+        storeBuffer(
+            module->getModuleIdentifier(),
+            obj.getBuffer(),
+            llvm::sys::fs::all_read | llvm::sys::fs::owner_write);
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer>
+    getObject(const llvm::Module* module) override {
+        return getObject(module->getModuleIdentifier());
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const std::string& key) {
+        auto buffer = llvm::MemoryBuffer::getFile(getPath(key));
+        if (!buffer) {
+            return nullptr;
+        }
+        return std::move(*buffer);
+    }
+
+  private:
+    /**
+     * Write an entry, it's renamed into place so a concurrent reader never
+     * sees a partial entry
+     */
+    void storeBuffer(
+        const std::string&   key,
+        llvm::StringRef      data,
+        llvm::sys::fs::perms perms) const {
+        llvm::SmallString<128> tmpPath;
+        int                    fd;
+        if (llvm::sys::fs::createUniqueFile(
+                getPath(key + ".tmp-%%%%%%"), fd, tmpPath)) {
+            return;
+        }
+        {
+            llvm::raw_fd_ostream out(fd, /* shouldClose */ true);
+            out << data;
+        }
+        llvm::sys::fs::setPermissions(tmpPath, perms);
+        if (llvm::sys::fs::rename(tmpPath, getPath(key))) {
+            llvm::sys::fs::remove(tmpPath);
+        }
+    }
+
+    /**
+     * Cache directory
+     */
+    std::string dir_;
+};
+
+#endif // EvaCache_h
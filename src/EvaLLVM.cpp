@@ -1,22 +1,45 @@
 #include "EvaLLVM.h"
 
 #include "Environment.h"
+#include "EvaCache.h"
 #include "EvaParser.h"
-
-#include <cstdarg>
+#include "EvaStats.h"
+#include "EvaVersion.h"
+#include "Trace.h"
+#include "runtime/EvaRuntime.h"
+
+#include <llvm/Analysis/CaptureTracking.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ModuleSummaryAnalysis.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Verifier.h>
-
-// dprintf is printf for debug messages, it's enabled with EVA_DEBUG env var
-void dprintf(const char* fmt, ...) {
-    static bool debug = std::getenv("EVA_DEBUG");
-    if (!debug) {
-        return;
-    }
-    va_list args;
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-}
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <optional>
+#include <regex>
+#include <set>
+#include <utility>
 
 std::string exp_type2str(ExpType type) {
     switch (type) {
@@ -34,11 +57,18 @@ std::string exp_type2str(ExpType type) {
 
 std::string exp_non_list2str(const Exp& exp) {
     if (exp.type == ExpType::NUMBER) {
-        return std::to_string(exp.number);
+        switch (exp.numberType) {
+        case NumberType::I64:
+            return std::to_string(exp.integer) + "L";
+        case NumberType::F64:
+            return std::to_string(exp.real);
+        default:
+            return std::to_string(exp.number);
+        }
     } else if (exp.type == ExpType::STRING) {
-        return "\"" + exp.string + "\"";
+        return "\"" + std::string(exp.string) + "\"";
     } else if (exp.type == ExpType::SYMBOL) {
-        return exp.string;
+        return std::string(exp.string);
     }
     return "UNKNOWN";
 }
@@ -66,6 +96,17 @@ std::string exp2str(const Exp& exp) {
     }
 }
 
+/**
+ * Name of a symbol, e.g. of a class or a function. The other nodes have no
+ * name, their string isn't set.
+ */
+static std::string symbolName(const Exp& exp) {
+    if (exp.type != ExpType::SYMBOL) {
+        throw std::runtime_error("Expected a name: " + exp2str(exp));
+    }
+    return std::string(exp.string);
+}
+
 template <typename T> std::string dumpValueToString(const T* V) {
     if (V == nullptr) {
         return "nullptr";
@@ -79,27 +120,112 @@ template <typename T> std::string dumpValueToString(const T* V) {
 }
 
 /**
- * Setup the target triple
+ * Setup the target triple and the host target machine
  */
 void EvaLLVM::setupTargetTriple() {
-    // TODO: use default target triple llvm::sys::getDefaultTargetTriple();
-    module->setTargetTriple("x86_64-unknown-linux-gnu");
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    const auto triple = llvm::sys::getDefaultTargetTriple();
+    module->setTargetTriple(triple);
+
+    std::string         error;
+    const llvm::Target* target =
+        llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        throw std::runtime_error("Unsupported target " + triple + ": " + error);
+    }
+
+    const llvm::CodeGenOpt::Level codeGenLevels[] = {
+        llvm::CodeGenOpt::None,
+        llvm::CodeGenOpt::Less,
+        llvm::CodeGenOpt::Default,
+        llvm::CodeGenOpt::Aggressive};
+    targetMachine.reset(target->createTargetMachine(
+        triple,
+        "generic",
+        "",
+        llvm::TargetOptions(),
+        llvm::Reloc::PIC_,
+        std::nullopt,
+        codeGenLevels[std::min(options_.optLevel, 3u)]));
+
+    // The optimizer and getTypeSize() rely on the target data layout
+    module->setDataLayout(targetMachine->createDataLayout());
 }
 
 /**
  * Execute the program
  */
 void EvaLLVM::eval(const std::string& program, const std::string& fileName) {
+    // The outputs are cached by the hash of the source and the options
+    const auto  outputKind = getOutputKind(fileName);
+    std::string cacheKey;
+    if (cache) {
+        EvaStats::Timer timer(stats.get(), "cache");
+        cacheKey = getCacheKey(program, outputKindNames[(int)outputKind]);
+        if (cache->load(cacheKey, fileName)) {
+            printf("\nUsing cached %s\n\n", fileName.c_str());
+            return;
+        }
+    }
 
-    // 1. Parse the program
-    printf("\nGenerating %s...\n\n", fileName.c_str());
-    auto ast = parser->parse("(begin " + program + ")");
+    if (options_.jobs > 1) {
+        evalParallel(program, fileName);
+    } else {
+        evalSerial(program, fileName);
+    }
 
-    // 2. Generate LLVM IR
-    compile(ast);
+    if (cache) {
+        EvaStats::Timer timer(stats.get(), "cache");
+        cache->store(cacheKey, fileName);
+    }
+}
 
-    // Verify the module for errors
-    llvm::verifyModule(*module, &llvm::outs());
+/**
+ * Hash of the runtime library linked into the executables, empty if it can't
+ * be read, then the linking fails too
+ */
+static const std::string& getRuntimeLibHash() {
+    static const std::string hash = [] {
+        auto buffer = llvm::MemoryBuffer::getFile(EVA_RUNTIME_LIB);
+        return buffer ? EvaCache::makeKey({(*buffer)->getBuffer()})
+                      : std::string();
+    }();
+    return hash;
+}
+
+/**
+ * Cache key of the program output, it covers everything the output depends
+ * on: the compiler version is its git commit, see cmake/version.cmake, and
+ * the executables also depend on the runtime library.
+ */
+std::string
+EvaLLVM::getCacheKey(const std::string& program, llvm::StringRef kind) {
+    static const char* compilerVersion =
+        "eva-llvm " EVA_VERSION ", LLVM " LLVM_VERSION_STRING;
+    return EvaCache::makeKey(
+        {program,
+         kind,
+         compilerVersion,
+         kind == outputKindNames[(int)OutputKind::Executable]
+             ? getRuntimeLibHash()
+             : "",
+         targetMachine->getTargetTriple().str(),
+         std::to_string(options_.optLevel),
+         options_.moduleSummary ? "summary" : "",
+         options_.fastMath ? "fast-math" : ""});
+}
+
+/**
+ * Compile the program in one module
+ */
+void EvaLLVM::evalSerial(
+    const std::string& program, const std::string& fileName) {
+    // 1-3. Parse, generate and optimize, the broken module is saved as is
+    // for inspection
+    printf("\nGenerating %s...\n\n", fileName.c_str());
+    buildModule(program);
 
     // Print the generated IR if "EVA_COUT" env is set
     if (std::getenv("EVA_COUT")) {
@@ -109,10 +235,691 @@ void EvaLLVM::eval(const std::string& program, const std::string& fileName) {
         printf("\nGenerated IR end\n\n");
     }
 
-    // 3. Save module IR to file:
+    // 4. Save module IR, object or executable to file:
+    EvaStats::Timer timer(stats.get(), "save");
     saveModuleToFile(fileName);
 }
 
+/**
+ * Number of the AST nodes in the expression
+ */
+static size_t expSize(const Exp& exp) {
+    if (exp.type != ExpType::LIST) {
+        return 1;
+    }
+    size_t size = 1;
+    for (const auto& e : exp.list) {
+        size += expSize(e);
+    }
+    return size;
+}
+
+/**
+ * Check the expression is a special form, e.g. (def ...)
+ */
+static bool isForm(const Exp& exp, Keyword keyword) {
+    return exp.type == ExpType::LIST && !exp.list.empty() &&
+        exp.list[0].is(keyword);
+}
+
+/**
+ * Collect the expressions in the tail position of a function body: the body
+ * itself, the last expression of a block and the branches of an if
+ */
+static void collectTailExps(const Exp& exp, std::set<const Exp*>& tailExps) {
+    tailExps.insert(&exp);
+    if (isForm(exp, KW_BEGIN) && exp.list.size() > 1) {
+        collectTailExps(exp.list[exp.list.size() - 1], tailExps);
+    } else if (isForm(exp, KW_IF) && exp.list.size() == 4) {
+        collectTailExps(exp.list[2], tailExps);
+        collectTailExps(exp.list[3], tailExps);
+    }
+}
+
+/**
+ * Number of lanes of a vector type or constructor, e.g. (vec4 f32), 0 for
+ * the rest
+ */
+static unsigned getVectorLanes(const Exp& exp) {
+    if (exp.type != ExpType::LIST || exp.list.empty()) {
+        return 0;
+    }
+    switch (exp.list[0].type == ExpType::SYMBOL ? exp.list[0].symbol : 0) {
+    case KW_VEC2:
+        return 2;
+    case KW_VEC4:
+        return 4;
+    case KW_VEC8:
+        return 8;
+    case KW_VEC16:
+        return 16;
+    }
+    return 0;
+}
+
+/**
+ * Fields of the array header
+ */
+static const char* const arrayFieldNames[] = {"size", "capacity", "data"};
+
+/**
+ * Check it's an array type: (array f64)
+ */
+static bool isArrayType(const Exp& type) {
+    return type.type == ExpType::LIST && type.list.size() == 2 &&
+        type.list[0].is(KW_ARRAY);
+}
+
+/**
+ * Check the type is a builtin type, the rest are classes
+ */
+static bool isBuiltinType(const Exp& type) {
+    if (isArrayType(type)) {
+        return isBuiltinType(type.list[1]);
+    } else if (type.type == ExpType::LIST) {
+        return type.list.size() == 2 && getVectorLanes(type) != 0;
+    }
+    return type.type == ExpType::SYMBOL &&
+        (type.string == "number" || type.string == "i32" ||
+         type.string == "i64" || type.string == "f32" ||
+         type.string == "f64" || type.string == "string");
+}
+
+/**
+ * Check it's a number type, e.g. f64
+ */
+static bool isNumberType(const Exp& type) {
+    return type.type == ExpType::SYMBOL && isBuiltinType(type) &&
+        type.string != "string";
+}
+
+/**
+ * Check the function signature has only the builtin types, so it can be
+ * declared before the classes are
+ */
+static bool hasBuiltinSignature(const Exp& def) {
+    if (def.list.size() == 6 && !isBuiltinType(def.list[4])) {
+        return false;
+    }
+    return std::all_of(
+        def.list[2].list.begin(), def.list[2].list.end(), [&](const Exp& arg) {
+            return arg.type != ExpType::LIST ||
+                (arg.list.size() == 2 && isBuiltinType(arg.list[1]));
+        });
+}
+
+/**
+ * Check the special form is used anywhere in the expression
+ */
+static bool containsForm(const Exp& exp, Keyword keyword) {
+    if (isForm(exp, keyword)) {
+        return true;
+    }
+    return exp.type == ExpType::LIST &&
+        std::any_of(exp.list.begin(), exp.list.end(), [&](const Exp& e) {
+               return containsForm(e, keyword);
+           });
+}
+
+/**
+ * Compile the program in partitions on a thread pool. Every partition has its
+ * own context and module, it declares all the functions and classes and
+ * defines only its share of them. The partitions are emitted as separate
+ * objects for an executable, otherwise they are linked into this module.
+ */
+void EvaLLVM::evalParallel(
+    const std::string& program, const std::string& fileName) {
+    printf(
+        "\nGenerating %s in %u partitions...\n\n",
+        fileName.c_str(),
+        options_.jobs);
+
+    const auto ast = parseProgram(program);
+    const auto owners = partitionForms(ast, options_.jobs);
+
+    // The workers are created upfront, the target setup isn't thread safe.
+    // This instance is the partition 0.
+    std::vector<std::unique_ptr<EvaLLVM>> workers;
+    std::vector<EvaLLVM*>                 partitions = {this};
+    for (unsigned i = 1; i < options_.jobs; i++) {
+        workers.push_back(std::make_unique<EvaLLVM>(options_));
+        partitions.push_back(workers.back().get());
+    }
+
+    const auto outputKind = getOutputKind(fileName);
+    std::vector<std::string>                errors(partitions.size());
+    std::vector<std::string>                objFileNames(partitions.size());
+    std::vector<llvm::SmallVector<char, 0>> bitcodes(partitions.size());
+
+    std::optional<EvaStats::Timer> partitionsTimer;
+    partitionsTimer.emplace(stats.get(), "partitions");
+    llvm::ThreadPool pool(llvm::hardware_concurrency(options_.jobs));
+    for (unsigned i = 0; i < partitions.size(); i++) {
+        pool.async([&, i] {
+            try {
+                auto partition = partitions[i];
+                // every worker parses the program into its own symbol table
+                partition->compilePartition(
+                    i == 0 ? ast
+                           : partition->parser->parse("(begin " + program + ")"),
+                    owners,
+                    i);
+
+                if (outputKind == OutputKind::Executable) {
+                    objFileNames[i] =
+                        fileName + ".part" + std::to_string(i) + ".o";
+                    partition->emitObjectFile(objFileNames[i]);
+                } else if (i != 0) {
+                    llvm::raw_svector_ostream out(bitcodes[i]);
+                    llvm::WriteBitcodeToFile(*partition->module, out);
+                }
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    pool.wait();
+    partitionsTimer.reset();
+
+    for (const auto& error : errors) {
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+    if (stats) {
+        for (auto partition : partitions) {
+            countModule(*partition->module);
+        }
+    }
+
+    EvaStats::Timer timer(stats.get(), "save");
+
+    if (outputKind == OutputKind::Executable) {
+        linkExecutable(objFileNames, fileName);
+        for (const auto& objFileName : objFileNames) {
+            llvm::sys::fs::remove(objFileName);
+        }
+    } else {
+        // The modules live in different contexts, so they are moved over as
+        // bitcode
+        for (size_t i = 1; i < partitions.size(); i++) {
+            auto partitionModule = llvm::parseBitcodeFile(
+                llvm::MemoryBufferRef(
+                    llvm::StringRef(bitcodes[i].data(), bitcodes[i].size()),
+                    "partition" + std::to_string(i)),
+                *context);
+            if (!partitionModule) {
+                throw std::runtime_error(
+                    llvm::toString(partitionModule.takeError()));
+            }
+            if (llvm::Linker::linkModules(
+                    *module, std::move(*partitionModule))) {
+                throw std::runtime_error("Linking the partitions failed");
+            }
+        }
+        saveModuleToFile(fileName);
+    }
+}
+
+/**
+ * Assign the top-level forms to the partitions. The functions and the
+ * classes are balanced by their AST size, the rest of the forms make up main,
+ * which is in the partition 0.
+ */
+std::vector<unsigned>
+EvaLLVM::partitionForms(const Exp& ast, unsigned partitions) {
+    std::vector<unsigned> owners(ast.list.size(), 0);
+    std::vector<size_t>   loads(partitions, 0);
+    for (size_t i = 1; i < ast.list.size(); i++) {
+        const auto& form = ast.list[i];
+        const auto  size = expSize(form);
+        if (!isForm(form, KW_DEF) && !isForm(form, KW_CLASS)) {
+            loads[0] += size;
+            continue;
+        }
+        const auto least = std::min_element(loads.begin(), loads.end());
+        owners[i] = least - loads.begin();
+        *least += size;
+    }
+    return owners;
+}
+
+/**
+ * Generate one partition of the program. All the functions and classes are
+ * declared up front, like buildClassInfo does for the methods, and only the
+ * ones owned by the partition are defined. The rest are external
+ * declarations resolved at link time.
+ */
+void EvaLLVM::compilePartition(
+    const Exp& ast, const std::vector<unsigned>& owners, unsigned partition) {
+    auto env = std::make_shared<Environment>(
+        std::map<std::string, ValueType>{}, globalEnv);
+    scanClassHierarchy(ast);
+    usesRegions_ = containsForm(ast, KW_REGION);
+
+    // 1. Declarations
+    std::set<llvm::GlobalValue*> ownedGlobals;
+    for (size_t i = 1; i < ast.list.size(); i++) {
+        const auto& form = ast.list[i];
+        if (isForm(form, KW_DEF)) {
+            declareFunction(form, env);
+        } else if (isForm(form, KW_CLASS)) {
+            declareClass(form, env);
+            if (owners[i] == partition) {
+                ownedGlobals.insert(
+                    classMap_[symbolName(form.list[1])].vtable);
+            }
+        }
+    }
+
+    // 2. Definitions, main and the globals are in the partition 0
+    if (partition == 0) {
+        fn = createFunction(
+            "main",
+            llvm::FunctionType::get(builder->getInt32Ty(), false),
+            globalEnv);
+        ownedGlobals.insert(module->getNamedGlobal("VERSION"));
+    }
+    for (size_t i = 1; i < ast.list.size(); i++) {
+        const auto& form = ast.list[i];
+        if (owners[i] != partition) {
+            continue;
+        }
+        if (isForm(form, KW_DEF)) {
+            genDef(form, env);
+        } else if (isForm(form, KW_CLASS)) {
+            defineClassMethods(form, env);
+        } else {
+            gen(form, env);
+        }
+    }
+    if (partition == 0) {
+        builder->CreateRet(builder->getInt32(0));
+    }
+
+    // 3. The globals of the other partitions are declarations
+    for (auto& global : module->globals()) {
+        if (!global.hasLocalLinkage() && !ownedGlobals.count(&global)) {
+            global.setInitializer(nullptr);
+        }
+    }
+
+    if (llvm::verifyModule(*module, &llvm::outs())) {
+        throw std::runtime_error(
+            "Partition " + std::to_string(partition) + " is broken");
+    }
+    optimizeModule();
+}
+
+/**
+ * Execute the program in-process with the JIT, returns the exit code of main
+ */
+int EvaLLVM::run(const std::string& program) {
+    // A cached object skips parsing and code generation, the lazy JIT
+    // compiles per function and isn't cached
+    if (cache && !options_.lazyJIT) {
+        const auto cacheKey = getCacheKey(program, "jit");
+        if (auto obj = cache->getObject(cacheKey)) {
+            initJIT();
+            if (auto err = jit->addObjectFile(std::move(obj))) {
+                throw std::runtime_error(llvm::toString(std::move(err)));
+            }
+            return callJITFunction("main");
+        }
+        // the JIT stores the object under the module identifier
+        module->setModuleIdentifier(cacheKey);
+        initJIT(cache.get());
+    }
+
+    if (!buildModule(program)) {
+        throw std::runtime_error("The module is broken, see the errors above");
+    }
+    return runModule();
+}
+
+/**
+ * Parse the program, generate and optimize the module, returns false if the
+ * module is broken
+ */
+bool EvaLLVM::buildModule(const std::string& program) {
+    // 1. Parse the program
+    auto ast = parseProgram(program);
+
+    // 2. Generate LLVM IR
+    {
+        EvaStats::Timer timer(stats.get(), "codegen");
+        compile(ast);
+    }
+    if (stats) {
+        countModule(*module);
+    }
+
+    // Verify the module for errors
+    {
+        EvaStats::Timer timer(stats.get(), "verify");
+        if (llvm::verifyModule(*module, &llvm::outs())) {
+            return false;
+        }
+    }
+
+    // 3. Optimize
+    EvaStats::Timer timer(stats.get(), "optimize");
+    optimizeModule();
+    return true;
+}
+
+/**
+ * Parse the program into the top-level begin block. With the statistics the
+ * tokenizer also runs on its own first, the parser pulls the tokens on demand
+ * so this is the only way to time it apart.
+ */
+Exp EvaLLVM::parseProgram(const std::string& program) {
+    auto source = "(begin " + program + ")";
+    if (stats) {
+        EvaStats::Timer   timer(stats.get(), "tokenize");
+        syntax::Tokenizer tokenizer;
+        tokenizer.initString(source);
+        while (tokenizer.getNextToken().type != syntax::TokenType::__EOF) {
+            stats->tokens++;
+        }
+    }
+
+    EvaStats::Timer timer(stats.get(), "parse");
+    auto            ast = parser->parse(std::move(source));
+    if (stats) {
+        stats->astNodes += expSize(ast);
+    }
+    return ast;
+}
+
+/**
+ * Add the functions and the instructions of the module to the statistics
+ */
+void EvaLLVM::countModule(const llvm::Module& module) {
+    for (const auto& function : module) {
+        if (!function.isDeclaration()) {
+            stats->functions++;
+            stats->instructions += function.getInstructionCount();
+        }
+    }
+}
+
+/**
+ * Print the statistics report, if it's enabled
+ */
+void EvaLLVM::printStats() {
+    if (!stats) {
+        return;
+    }
+    stats->classes = classMap_.size();
+    stats->envLookups = Environment::lookups;
+
+    FILE* out = stderr;
+    if (!options_.statsFile.empty()) {
+        out = fopen(options_.statsFile.c_str(), "w");
+        if (out == nullptr) {
+            throw std::runtime_error(
+                "Can't open the statistics file: " + options_.statsFile);
+        }
+    }
+    if (options_.stats == StatsFormat::JSON) {
+        stats->printJSON(out);
+    } else {
+        stats->print(out);
+    }
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+/**
+ * Hand the module over to an ORC JIT and call main, the module is consumed
+ */
+int EvaLLVM::runModule() {
+    EvaStats::Timer timer(stats.get(), "jit");
+    initJIT();
+    addModuleToJIT(std::move(module));
+    return callJITFunction("main");
+}
+
+/**
+ * Compile and run one REPL input in a fresh module. The top-level forms are
+ * compiled right in the global environment, so the variables, functions and
+ * classes stay visible to the next inputs without recompiling them.
+ */
+void EvaLLVM::evalIncremental(const std::string& input) {
+    if (!module) {
+        nextModule();
+    }
+    // the entry function is named after the input, it's called once
+    const auto fnName = "__repl_" + std::to_string(++replInputs_);
+    // the functions may be called in a region of a later input
+    usesRegions_ = true;
+    // nothing a failed input defines is kept, its module isn't in the JIT
+    auto defExps = defExps_;
+    auto globals = *globalEnv;
+    auto functions = functions_;
+    auto classes = classMap_;
+    try {
+        const auto ast = parser->parse("(begin " + input + ")");
+
+        fn = createFunction(
+            fnName,
+            llvm::FunctionType::get(builder->getInt32Ty(), false),
+            globalEnv);
+        for (size_t i = 1; i < ast.list.size(); i++) {
+            gen(ast.list[i], globalEnv);
+        }
+        builder->CreateRet(builder->getInt32(0));
+
+        if (llvm::verifyModule(*module, &llvm::outs())) {
+            throw std::runtime_error("The module is broken, see the errors above");
+        }
+        optimizeModule();
+
+        initJIT();
+        addModuleToJIT(llvm::CloneModule(*module));
+    } catch (...) {
+        // keep the module alive, the environment may reference its values
+        classType = nullptr;
+        regionDepth_ = 0;
+        maybeInRegion_ = false;
+        loops_.clear();
+        accessGroups_.clear();
+        defExps_ = std::move(defExps);
+        *globalEnv = std::move(globals);
+        functions_ = std::move(functions);
+        classMap_ = std::move(classes);
+        pureFunctions_.clear();
+        replModules_.push_back(std::move(module));
+        throw;
+    }
+
+    // The JIT frees its copy once it's compiled, so the environment keeps
+    // referencing this one, only the declarations are needed from now on
+    for (auto& moduleFn : *module) {
+        moduleFn.deleteBody();
+    }
+    for (auto& moduleGlobal : module->globals()) {
+        moduleGlobal.setInitializer(nullptr);
+        moduleGlobal.setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+    replModules_.push_back(std::move(module));
+
+    callJITFunction(fnName);
+}
+
+/**
+ * Start a new module for the next REPL input
+ */
+void EvaLLVM::nextModule() {
+    module = std::make_unique<llvm::Module>("EvaLLVM", *context);
+    module->setTargetTriple(targetMachine->getTargetTriple().str());
+    module->setDataLayout(targetMachine->createDataLayout());
+    setupExternalFunctions();
+}
+
+/**
+ * Get a declaration in the current module for a global value defined by one
+ * of the previous modules, other values are returned as is
+ */
+llvm::Value* EvaLLVM::importValue(llvm::Value* value) {
+    auto global = llvm::dyn_cast_or_null<llvm::GlobalValue>(value);
+    if (global == nullptr || global->getParent() == module.get()) {
+        return value;
+    }
+    if (auto fn = llvm::dyn_cast<llvm::Function>(global)) {
+        // the attributes inferred in its module still hold
+        return module
+            ->getOrInsertFunction(
+                fn->getName(), fn->getFunctionType(), fn->getAttributes())
+            .getCallee();
+    }
+    return module->getOrInsertGlobal(global->getName(), global->getValueType());
+}
+
+/**
+ * Create the JIT on the first use
+ */
+void EvaLLVM::initJIT(llvm::ObjectCache* objectCache) {
+    if (jit) {
+        return;
+    }
+
+    // GC_malloc is resolved from libgc loaded into the host process
+    std::string error;
+    if (llvm::sys::DynamicLibrary::LoadLibraryPermanently("libgc.so", &error) &&
+        llvm::sys::DynamicLibrary::LoadLibraryPermanently(
+            "libgc.so.1", &error)) {
+        throw std::runtime_error("Can't load libgc: " + error);
+    }
+    EvaGcFunctions gcFunctions = {
+        (void* (*)(size_t))llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            "GC_malloc"),
+        (void* (*)(size_t))llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            "GC_malloc_atomic"),
+        (void* (*)(size_t))llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            "GC_malloc_uncollectable"),
+        (void (*)(void*))llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            "GC_free"),
+    };
+    if (!gcFunctions.malloc || !gcFunctions.mallocAtomic ||
+        !gcFunctions.mallocUncollectable || !gcFunctions.free) {
+        throw std::runtime_error("Can't find the libgc functions");
+    }
+    eva_runtime_init(&gcFunctions);
+
+    jit = createJIT(objectCache);
+
+    // Unresolved symbols (GC_malloc, printf) are looked up in the process
+    auto generator =
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            jit->getDataLayout().getGlobalPrefix());
+    if (!generator) {
+        throw std::runtime_error(llvm::toString(generator.takeError()));
+    }
+    jit->getMainJITDylib().addGenerator(std::move(*generator));
+
+    // the runtime library is linked into the compiler
+    llvm::orc::MangleAndInterner mangle(
+        jit->getExecutionSession(), jit->getDataLayout());
+    llvm::orc::SymbolMap runtimeSymbols;
+    for (const auto& [name, address] :
+         std::initializer_list<std::pair<const char*, void*>>{
+             {"eva_region_enter", (void*)&eva_region_enter},
+             {"eva_region_exit", (void*)&eva_region_exit},
+             {"eva_region_alloc", (void*)&eva_region_alloc},
+             {"eva_alloc", (void*)&eva_alloc},
+             {"eva_array_new", (void*)&eva_array_new},
+             {"eva_array_grow", (void*)&eva_array_grow},
+             {"eva_array_bounds_fail", (void*)&eva_array_bounds_fail},
+         }) {
+        runtimeSymbols[mangle(name)] = llvm::orc::ExecutorSymbolDef(
+            llvm::orc::ExecutorAddr::fromPtr(address),
+            llvm::JITSymbolFlags::Exported);
+    }
+    if (auto err = jit->getMainJITDylib().define(
+            llvm::orc::absoluteSymbols(std::move(runtimeSymbols)))) {
+        throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+}
+
+/**
+ * Hand the module over to the JIT
+ */
+void EvaLLVM::addModuleToJIT(std::unique_ptr<llvm::Module> jitModule) {
+    jitModule->setDataLayout(jit->getDataLayout());
+    llvm::orc::ThreadSafeModule tsm(std::move(jitModule), threadSafeContext);
+
+    auto err = options_.lazyJIT
+                   ? static_cast<llvm::orc::LLLazyJIT&>(*jit).addLazyIRModule(
+                         std::move(tsm))
+                   : jit->addIRModule(std::move(tsm));
+    if (err) {
+        throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+}
+
+/**
+ * Call a JIT compiled function without arguments, returns its result
+ */
+int EvaLLVM::callJITFunction(const std::string& fnName) {
+    auto fnAddr = jit->lookup(fnName);
+    if (!fnAddr) {
+        throw std::runtime_error(llvm::toString(fnAddr.takeError()));
+    }
+    auto jitFn = fnAddr->toPtr<int (*)()>();
+    return jitFn();
+}
+
+/**
+ * Create the JIT for the run mode, the lazy one compiles functions and class
+ * methods only when they are called for the first time
+ */
+std::unique_ptr<llvm::orc::LLJIT>
+EvaLLVM::createJIT(llvm::ObjectCache* objectCache) {
+    if (!options_.lazyJIT) {
+        llvm::orc::LLJITBuilder jitBuilder;
+        if (objectCache != nullptr) {
+            // the compiled objects go through the cache
+            jitBuilder.setCompileFunctionCreator(
+                [objectCache](llvm::orc::JITTargetMachineBuilder jtmb)
+                    -> llvm::Expected<
+                        std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                    auto tm = jtmb.createTargetMachine();
+                    if (!tm) {
+                        return tm.takeError();
+                    }
+                    return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+                        std::move(*tm), objectCache);
+                });
+        }
+        auto jit = jitBuilder.create();
+        if (!jit) {
+            throw std::runtime_error(llvm::toString(jit.takeError()));
+        }
+        return std::move(*jit);
+    }
+
+    // The first call of a function goes through the lazy reentry, which
+    // keeps only the SSE part of the vector registers, so the code is
+    // generic as the compiled executables, the vectors aren't passed in the
+    // AVX ones
+    auto jit = llvm::orc::LLLazyJITBuilder()
+                   .setJITTargetMachineBuilder(
+                       llvm::orc::JITTargetMachineBuilder(
+                           llvm::Triple(llvm::sys::getProcessTriple())))
+                   .create();
+    if (!jit) {
+        throw std::runtime_error(llvm::toString(jit.takeError()));
+    }
+    // One partition per function: the calls go through the lazy stubs, and
+    // vtables reference the stubs too, so only the called code is compiled
+    (*jit)->setPartitionFunction(
+        llvm::orc::CompileOnDemandLayer::compileRequested);
+    return std::move(*jit);
+}
+
 /**
  * Setup the global environment
  */
@@ -136,6 +943,9 @@ void EvaLLVM::setupGlobalEnvironment() {
  * Compile an expression
  */
 void EvaLLVM::compile(const Exp& ast) {
+    scanClassHierarchy(ast);
+    usesRegions_ = containsForm(ast, KW_REGION);
+
     // 1. Create a function
     fn = createFunction(
         "main",
@@ -146,6 +956,15 @@ void EvaLLVM::compile(const Exp& ast) {
 
     createGlobalVar("VERSION", builder->getInt32(10));
 
+    // the functions can call the ones defined after them, e.g. the mutually
+    // recursive ones, the class types are only known once they're defined
+    for (size_t i = 1; i < ast.list.size(); i++) {
+        const auto& form = ast.list[i];
+        if (isForm(form, KW_DEF) && hasBuiltinSignature(form)) {
+            declareFunction(form, globalEnv);
+        }
+    }
+
     // 2. Compile main body
     const auto result = gen(ast, globalEnv);
 
@@ -175,8 +994,11 @@ llvm::Function* EvaLLVM::createFunction(
 llvm::Function* EvaLLVM::createFunctionProto(
     const std::string& fnName, llvm::FunctionType* fnType, Env env) {
     auto fn = llvm::Function::Create(
-        fnType, llvm::Function::ExternalLinkage, fnName, *module);
+        fnType, getFunctionLinkage(fnName), fnName, *module);
+    // there are no exceptions, nothing unwinds through the generated code
+    fn->setDoesNotThrow();
     llvm::verifyFunction(*fn);
+    registerFunction(fnName, fn);
 
     // Create a new environment for the function
     env->define(fnName, fn, fn->getType());
@@ -184,6 +1006,20 @@ llvm::Function* EvaLLVM::createFunctionProto(
     return fn;
 }
 
+/**
+ * Linkage of a generated function. A module with the whole program only
+ * exports main, so the optimizer knows all the callers of the rest. The
+ * partitions and the REPL inputs call each other's functions, they're
+ * external there.
+ */
+llvm::GlobalValue::LinkageTypes
+EvaLLVM::getFunctionLinkage(const std::string& fnName) {
+    if (fnName == "main" || options_.jobs > 1 || replInputs_ != 0) {
+        return llvm::Function::ExternalLinkage;
+    }
+    return llvm::Function::InternalLinkage;
+}
+
 /**
  * Create a function block
  */
@@ -201,590 +1037,1928 @@ EvaLLVM::createBB(const std::string& name, llvm::Function* fn) {
 }
 
 /**
- * Main compile loop
+ * Special forms, indexed by the keyword symbol id
+ */
+const std::vector<EvaLLVM::GenHandler> EvaLLVM::genHandlers_ = [] {
+    std::vector<GenHandler> handlers(KEYWORDS_COUNT, nullptr);
+    handlers[KW_PRINTF] = &EvaLLVM::genPrintf;
+    handlers[KW_VAR] = &EvaLLVM::genVar;
+    handlers[KW_BEGIN] = &EvaLLVM::genBegin;
+    handlers[KW_SET] = &EvaLLVM::genSet;
+    handlers[KW_ADD] = &EvaLLVM::genArithmetic;
+    handlers[KW_SUB] = &EvaLLVM::genArithmetic;
+    handlers[KW_MUL] = &EvaLLVM::genArithmetic;
+    handlers[KW_DIV] = &EvaLLVM::genArithmetic;
+    handlers[KW_EQ] = &EvaLLVM::genComparison;
+    handlers[KW_NE] = &EvaLLVM::genComparison;
+    handlers[KW_LT] = &EvaLLVM::genComparison;
+    handlers[KW_LE] = &EvaLLVM::genComparison;
+    handlers[KW_GT] = &EvaLLVM::genComparison;
+    handlers[KW_GE] = &EvaLLVM::genComparison;
+    handlers[KW_IF] = &EvaLLVM::genIf;
+    handlers[KW_WHILE] = &EvaLLVM::genWhile;
+    handlers[KW_DEF] = &EvaLLVM::genDef;
+    handlers[KW_CLASS] = &EvaLLVM::genClass;
+    handlers[KW_PROP] = &EvaLLVM::genProp;
+    handlers[KW_METHOD] = &EvaLLVM::genMethod;
+    handlers[KW_REGION] = &EvaLLVM::genRegion;
+    handlers[KW_VEC2] = &EvaLLVM::genVector;
+    handlers[KW_VEC4] = &EvaLLVM::genVector;
+    handlers[KW_VEC8] = &EvaLLVM::genVector;
+    handlers[KW_VEC16] = &EvaLLVM::genVector;
+    handlers[KW_LANE] = &EvaLLVM::genLane;
+    handlers[KW_SHUFFLE] = &EvaLLVM::genShuffle;
+    handlers[KW_REDUCE] = &EvaLLVM::genReduce;
+    handlers[KW_ARRAY] = &EvaLLVM::genArray;
+    handlers[KW_AT] = &EvaLLVM::genAt;
+    handlers[KW_PUSH] = &EvaLLVM::genPush;
+    handlers[KW_LEN] = &EvaLLVM::genLen;
+    handlers[KW_FOR] = &EvaLLVM::genFor;
+    handlers[KW_PARALLEL_FOR] = &EvaLLVM::genFor;
+    handlers[KW_BREAK] = &EvaLLVM::genBreak;
+    handlers[KW_CONTINUE] = &EvaLLVM::genBreak;
+    handlers[KW_CONST_EVAL] = &EvaLLVM::genConstEval;
+    return handlers;
+}();
+
+/**
+ * Main compile loop
+ */
+ValueType EvaLLVM::gen(const Exp& exp, Env env) {
+
+    ValueType result{nullptr, nullptr};
+    EVA_TRACE(
+        TRACE_GEN,
+        "%*sgen: %s\n",
+        traceIndent(),
+        "",
+        exp2str(exp).c_str());
+    EVA_TRACE_SCOPE(traceDepth_);
+
+    switch (exp.type) {
+
+    case ExpType::NUMBER:
+        switch (exp.numberType) {
+        case NumberType::I32:
+            result = {builder->getInt32(exp.number), nullptr};
+            break;
+        case NumberType::I64:
+            result = {builder->getInt64(exp.integer), nullptr};
+            break;
+        case NumberType::F64:
+            result = {
+                llvm::ConstantFP::get(builder->getDoubleTy(), exp.real),
+                nullptr};
+            break;
+        }
+        break;
+
+    case ExpType::STRING: {
+        // handle \\n
+        auto re = std::regex("\\\\n");
+        auto str = std::regex_replace(std::string(exp.string), re, "\n");
+        result = {builder->CreateGlobalStringPtr(str), builder->getInt8Ty()};
+        break;
+    }
+
+    case ExpType::SYMBOL:
+        result = genSymbol(exp, env);
+        break;
+
+    case ExpType::LIST: {
+        if (exp.list.empty()) {
+            throw std::runtime_error("Empty list");
+        }
+
+        const auto& tag = exp.list[0];
+        if (tag.type != ExpType::SYMBOL) {
+            break;
+        }
+
+        // Special forms are dispatched by the keyword id, everything else is
+        // a function or a functor call.
+        if (tag.symbol < KEYWORDS_COUNT &&
+            genHandlers_[tag.symbol] != nullptr) {
+            result = (this->*genHandlers_[tag.symbol])(exp, env);
+        } else {
+            result = genCall(exp, env);
+        }
+        break;
+    } // case LIST
+    } // switch
+
+    if (result.value == nullptr) {
+        printf(
+            "Not handled %s: %s\n",
+            exp_type2str(exp.type).c_str(),
+            exp2str(exp).c_str());
+        throw std::runtime_error("Not implemented");
+    }
+    EVA_TRACE(
+        TRACE_GEN,
+        "%*sgen result: value %s, type %s\n",
+        traceIndent(),
+        "",
+        dumpValueToString(result.value).c_str(),
+        dumpValueToString(result.type).c_str());
+    return result;
+}
+
+/**
+ * Symbol: boolean, function call without arguments or variable
+ */
+ValueType EvaLLVM::genSymbol(const Exp& exp, Env env) {
+    /**
+     * Boolean
+     */
+    if (exp.is(KW_TRUE)) {
+        return {builder->getInt1(true), nullptr};
+    } else if (exp.is(KW_FALSE)) {
+        return {builder->getInt1(false), nullptr};
+    }
+
+    auto varName = std::string(exp.string);
+
+    // printf("Calling a function: %s\n", varName.c_str());
+    auto fn = getFunctionBySymbol(exp.symbol);
+    if (fn != nullptr) {
+        EVA_TRACE(
+            TRACE_FUNC,
+            "%*sFunction found: %s\n",
+            traceIndent(),
+            "",
+            varName.c_str());
+        return {builder->CreateCall(fn), nullptr};
+    }
+
+    // Variables:
+    // printf("Looking up variable: %s\n", varName.c_str());
+    // cast to stack allocated value: AllocaInst
+    auto var = env->lookup(varName);
+    var.value = importValue(var.value);
+    auto varAlloca = llvm::dyn_cast<llvm::AllocaInst>(var.value);
+    // 1. Local variables:
+    if (varAlloca != nullptr) {
+        EVA_TRACE(
+            TRACE_VAR,
+            "%*sVariable found (AllocaInst): %s\n",
+            traceIndent(),
+            "",
+            varName.c_str());
+        return {
+            builder->CreateLoad(
+                varAlloca->getAllocatedType(), varAlloca, varName.c_str()),
+            var.type};
+    }
+
+    // 2. Global variables
+    auto varGlobal = llvm::dyn_cast<llvm::GlobalVariable>(var.value);
+    if (varGlobal != nullptr) {
+        EVA_TRACE(
+            TRACE_VAR,
+            "%*sVariable found (GlobalVariable): %s\n",
+            traceIndent(),
+            "",
+            varName.c_str());
+        return {
+            builder->CreateLoad(
+                varGlobal->getValueType(), varGlobal, varName.c_str()),
+            var.type};
+    }
+
+    // last resort: variables
+    if (var.value) {
+        EVA_TRACE(
+            TRACE_VAR,
+            "%*sVariable found: %s, orig type %s\n",
+            traceIndent(),
+            "",
+            varName.c_str(),
+            dumpValueToString(var.type).c_str());
+        return var;
+    }
+
+    throw std::runtime_error("Symbol not implemented");
+}
+
+// ----------------------------------------------------
+// printf extern function:
+//
+// (printf "value %d" 42)
+//
+//
+ValueType EvaLLVM::genPrintf(const Exp& exp, Env env) {
+    const auto printfFn = getFunctionBySymbol(KW_PRINTF);
+    assert(printfFn && "Function 'printf' not found");
+
+    std::vector<llvm::Value*> args;
+
+    for (size_t i = 1; i < exp.list.size(); i++) {
+        auto arg = gen(exp.list[i], env).value;
+        if (arg->getType()->isVectorTy()) {
+            throw std::runtime_error(
+                "Vectors can't be printed, print their lanes: " +
+                exp2str(exp.list[i]));
+        }
+        // variadic arguments are promoted as in C
+        if (arg->getType()->isFloatTy()) {
+            arg = builder->CreateFPExt(arg, builder->getDoubleTy());
+        }
+        args.push_back(arg);
+    }
+
+    return {builder->CreateCall(printfFn, args), nullptr};
+}
+
+// ----------------------------------------------------
+// Variable delcaration: (var x (+ y 10))
+//
+// Typed: (var (x number) 42)
+// Derived type: ( var x ( prop self cell ) ) // Cell type
+//
+// Note: locals are allocated on the stack
+ValueType EvaLLVM::genVar(const Exp& exp, Env env) {
+    const auto& varNameDecl = exp.list[1];
+    const auto& varInitDecl = exp.list[2];
+    auto        varName = extractVarName(varNameDecl);
+    EVA_TRACE(
+        TRACE_VAR,
+        "%*sVariable declaration: %s\n",
+        traceIndent(),
+        "",
+        varName.c_str());
+
+    // Class instance creation
+    // (var p (new Point 1 2))
+    if (varInitDecl.type == ExpType::LIST && varInitDecl.list[0].is(KW_NEW)) {
+        const auto instance = createClassInstance(varInitDecl, env, varName);
+        const auto instanceType =
+            classMap_[symbolName(varInitDecl.list[1])].classType;
+        // REPL top-level instances outlive the input in a global
+        if (env == globalEnv) {
+            auto varGlobal = createGlobalVar(
+                varName, llvm::Constant::getNullValue(builder->getPtrTy()));
+            builder->CreateStore(instance, varGlobal);
+            env->define(varName, varGlobal, instanceType);
+        }
+        return {instance, instanceType};
+    }
+
+    // initializer
+    auto genValueType = gen(varInitDecl, env);
+    EVA_TRACE(
+        TRACE_VAR,
+        "%*sgen result: %s\n",
+        traceIndent(),
+        "",
+        dumpValueToString(genValueType.value).c_str());
+    EVA_TRACE(
+        TRACE_VAR,
+        "%*sgen type ptr: %s\n",
+        traceIndent(),
+        "",
+        dumpValueToString(genValueType.type).c_str());
+
+    // the number is converted to the declared type, e.g. (var (x f64) 0),
+    // the declared class or array type is kept, e.g. of a returned value
+    if (varNameDecl.type == ExpType::LIST && isBuiltinType(varNameDecl.list[1])) {
+        genValueType.value = castNumber(
+            genValueType.value, extractVarType(varNameDecl).type);
+    }
+    if (varNameDecl.type == ExpType::LIST && genValueType.type == nullptr) {
+        genValueType.type = extractVarType(varNameDecl).ptrType;
+    }
+
+    // variable, the REPL top-level ones are globals to outlive the input
+    const auto   varTy = genValueType.value->getType();
+    llvm::Value* varBinding = nullptr;
+    if (env == globalEnv) {
+        varBinding =
+            createGlobalVar(varName, llvm::Constant::getNullValue(varTy));
+    } else {
+        varBinding = allocVar(varName, varTy, env);
+    }
+    const auto definedType = genValueType.type == nullptr
+        ? genValueType.value->getType()
+        : genValueType.type;
+    env->define(varName, varBinding, definedType);
+    EVA_TRACE(
+        TRACE_VAR,
+        "%*sVariable binding: %s\n",
+        traceIndent(),
+        "",
+        dumpValueToString(varBinding).c_str());
+
+    // set value
+    assert(varBinding && "Variable not found");
+    builder->CreateStore(genValueType.value, varBinding);
+    return {varBinding, genValueType.type};
+}
+
+// ----------------------------------------------------
+// Block:
+// (begin <exp1> <exp2> ... <expN>)
+//
+ValueType EvaLLVM::genBegin(const Exp& exp, Env env) {
+    ValueType result{nullptr, nullptr};
+
+    // create new environment
+    auto record = std::map<std::string, ValueType>{};
+    auto newEnv = std::make_shared<Environment>(record, env);
+
+    for (size_t i = 1; i < exp.list.size(); i++) {
+        result = gen(exp.list[i], newEnv);
+    }
+    return result;
+}
+
+// ----------------------------------------------------
+// Region: the instances created while it runs are bump-allocated in an
+// arena and released all at once on exit, they must not outlive it
+// (region <exp1> <exp2> ... <expN>)
+//
+ValueType EvaLLVM::genRegion(const Exp& exp, Env env) {
+    auto mark = builder->CreateCall(
+        module->getFunction("eva_region_enter"), {}, "region");
+    regionDepth_++;
+    auto result = genBegin(exp, env);
+    regionDepth_--;
+    builder->CreateCall(module->getFunction("eva_region_exit"), mark);
+    return result;
+}
+
+// ----------------------------------------------------
+// set:
+// (set x 42)
+// (set (x string) "Hello, World!")
+//
+// Class property access:
+// (set (prop self Point x) x)
+//
+// Array element:
+// (set (at a i) x)
+ValueType EvaLLVM::genSet(const Exp& exp, Env env) {
+    // if it's a property access, call the setter
+    if (exp.list[1].type == ExpType::LIST && exp.list[1].list[0].is(KW_PROP)) {
+        auto newValue = gen(exp.list[2], env);
+        return {
+            accessProperty(exp.list[1], env, newValue.value).value,
+            newValue.type};
+    }
+    if (exp.list[1].type == ExpType::LIST && exp.list[1].list[0].is(KW_AT)) {
+        auto     newValue = gen(exp.list[2], env);
+        TypeType element;
+        auto     elementPtr = genElementPtr(exp.list[1], env, element);
+        auto     value = castNumber(newValue.value, element.type);
+        if (value->getType() != element.type) {
+            throw std::runtime_error("Invalid array element: " + exp2str(exp));
+        }
+        tagElementAccess(
+            builder->CreateStore(value, elementPtr), element.type);
+        return {value, newValue.type};
+    }
+
+    const auto& varNameDecl = exp.list[1];
+    const auto& varInitDecl = exp.list[2];
+    auto        varName = extractVarName(varNameDecl);
+
+    // initializer
+    auto genValue = gen(varInitDecl, env);
+
+    // type
+    // auto varTy = extractVarType(varNameDecl);
+
+    // variable
+    auto varInit = env->lookup(varName);
+    varInit.value = importValue(varInit.value);
+    EVA_TRACE(
+        TRACE_VAR,
+        "%*sVariable found: %s\n",
+        traceIndent(),
+        "",
+        dumpValueToString(varInit.value).c_str());
+    // auto varBinding =
+    //     llvm::dyn_cast<llvm::AllocaInst>(varInit.value);
+
+    // set value, the number is converted to the variable type
+    assert(varInit.value && "Variable not found");
+    if (auto local = llvm::dyn_cast<llvm::AllocaInst>(varInit.value)) {
+        genValue.value = castNumber(genValue.value, local->getAllocatedType());
+    } else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(varInit.value)) {
+        genValue.value = castNumber(genValue.value, global->getValueType());
+    } else {
+        throw std::runtime_error(
+            "Not a variable, it can't be set: " + exp2str(exp));
+    }
+    builder->CreateStore(genValue.value, varInit.value);
+    return {genValue.value, genValue.type};
+}
+
+// ----------------------------------------------------
+// Arithmetic operations:
+// (+ 1 2)
+// (- 1 2)
+// (* 1 2)
+// (/ 1 2)
+ValueType EvaLLVM::genArithmetic(const Exp& exp, Env env) {
+    auto lhs = gen(exp.list[1], env);
+    auto rhs = gen(exp.list[2], env);
+    return {
+        createArithmetic(exp.list[0].symbol, lhs.value, rhs.value), lhs.type};
+}
+
+/**
+ * Arithmetic operation on the numbers converted to their common type, the
+ * constants are folded
+ */
+llvm::Value*
+EvaLLVM::createArithmetic(uint32_t op, llvm::Value* lhs, llvm::Value* rhs) {
+    promoteOperands(lhs, rhs);
+
+    // the fast-math flags of the builder apply to the floating point ones,
+    // the vectors are computed lane by lane
+    if (lhs->getType()->isFPOrFPVectorTy()) {
+        switch (op) {
+        case KW_ADD:
+            return builder->CreateFAdd(lhs, rhs);
+        case KW_SUB:
+            return builder->CreateFSub(lhs, rhs);
+        case KW_MUL:
+            return builder->CreateFMul(lhs, rhs);
+        case KW_DIV:
+            return builder->CreateFDiv(lhs, rhs);
+        }
+        return nullptr;
+    }
+
+    switch (op) {
+    case KW_ADD:
+        return builder->CreateAdd(lhs, rhs);
+    case KW_SUB:
+        return builder->CreateSub(lhs, rhs);
+    case KW_MUL:
+        return builder->CreateMul(lhs, rhs);
+    case KW_DIV:
+        return builder->CreateSDiv(lhs, rhs);
+    }
+    return nullptr;
+}
+
+// ----------------------------------------------------
+// Comparison operations:
+// (== 1 2)
+// (!= 1 2)
+// (< 1 2)
+// (<= 1 2)
+// (> 1 2)
+// (>= 1 2)
+ValueType EvaLLVM::genComparison(const Exp& exp, Env env) {
+    auto lhs = gen(exp.list[1], env);
+    auto rhs = gen(exp.list[2], env);
+    if (lhs.value->getType()->isVectorTy() ||
+        rhs.value->getType()->isVectorTy()) {
+        throw std::runtime_error("Vectors can't be compared: " + exp2str(exp));
+    }
+    return {
+        createComparison(exp.list[0].symbol, lhs.value, rhs.value), lhs.type};
+}
+
+/**
+ * Comparison of the numbers converted to their common type, the constants
+ * are folded
+ */
+llvm::Value*
+EvaLLVM::createComparison(uint32_t op, llvm::Value* lhs, llvm::Value* rhs) {
+    promoteOperands(lhs, rhs);
+
+    // ordered, except != which is true for NaN
+    if (lhs->getType()->isFloatingPointTy()) {
+        switch (op) {
+        case KW_EQ:
+            return builder->CreateFCmpOEQ(lhs, rhs);
+        case KW_NE:
+            return builder->CreateFCmpUNE(lhs, rhs);
+        case KW_LT:
+            return builder->CreateFCmpOLT(lhs, rhs);
+        case KW_LE:
+            return builder->CreateFCmpOLE(lhs, rhs);
+        case KW_GT:
+            return builder->CreateFCmpOGT(lhs, rhs);
+        case KW_GE:
+            return builder->CreateFCmpOGE(lhs, rhs);
+        }
+        return nullptr;
+    }
+
+    switch (op) {
+    case KW_EQ:
+        return builder->CreateICmpEQ(lhs, rhs);
+    case KW_NE:
+        return builder->CreateICmpNE(lhs, rhs);
+    case KW_LT:
+        return builder->CreateICmpSLT(lhs, rhs);
+    case KW_LE:
+        return builder->CreateICmpSLE(lhs, rhs);
+    case KW_GT:
+        return builder->CreateICmpSGT(lhs, rhs);
+    case KW_GE:
+        return builder->CreateICmpSGE(lhs, rhs);
+    }
+    return nullptr;
+}
+
+// ----------------------------------------------------
+// Vector, the lanes are converted to the lane type:
+// (vec4 f32 1 2 3 4)
+// (vec8 i32 0) -- the same value in all the lanes
+//
+// The arithmetic operations work lane by lane, the numbers are used in all
+// the lanes: (* v 2)
+ValueType EvaLLVM::genVector(const Exp& exp, Env env) {
+    const auto vectorType = getVectorType(exp);
+    const auto lanes = vectorType->getNumElements();
+    if (exp.list.size() != 3 && exp.list.size() != lanes + 2) {
+        throw std::runtime_error(
+            "Vector expects 1 or " + std::to_string(lanes) +
+            " values: " + exp2str(exp));
+    }
+
+    llvm::Value* vector = nullptr;
+    if (exp.list.size() == 3) {
+        vector = castNumber(gen(exp.list[2], env).value, vectorType);
+    } else {
+        // constant lanes are folded into a constant vector
+        vector = llvm::PoisonValue::get(vectorType);
+        for (unsigned i = 0; i < lanes; i++) {
+            auto lane = castNumber(
+                gen(exp.list[i + 2], env).value, vectorType->getElementType());
+            if (lane->getType() != vectorType->getElementType()) {
+                throw std::runtime_error(
+                    "Invalid vector lane: " + exp2str(exp.list[i + 2]));
+            }
+            vector = builder->CreateInsertElement(vector, lane, i);
+        }
+    }
+    if (vector->getType() != vectorType) {
+        throw std::runtime_error("Invalid vector lane: " + exp2str(exp));
+    }
+    return {vector, nullptr};
+}
+
+// ----------------------------------------------------
+// Lane of a vector, a constant index must be one of the lanes, one known at
+// run time wraps around them:
+// (lane v 0)
+//
+ValueType EvaLLVM::genLane(const Exp& exp, Env env) {
+    auto vector = gen(exp.list[1], env).value;
+    auto vectorType = llvm::dyn_cast<llvm::FixedVectorType>(vector->getType());
+    if (vectorType == nullptr) {
+        throw std::runtime_error("Not a vector: " + exp2str(exp.list[1]));
+    }
+    auto index =
+        castNumber(gen(exp.list[2], env).value, builder->getInt32Ty());
+    const auto lanes = vectorType->getNumElements();
+    if (auto constIndex = llvm::dyn_cast<llvm::ConstantInt>(index)) {
+        if (constIndex->getValue().uge(lanes)) {
+            throw std::runtime_error("Invalid lane index: " + exp2str(exp));
+        }
+    } else {
+        // the lanes are a power of two
+        index = builder->CreateAnd(index, lanes - 1);
+    }
+    return {builder->CreateExtractElement(vector, index), nullptr};
+}
+
+// ----------------------------------------------------
+// Shuffle: the mask picks the lanes of the result, the lanes of the second
+// vector are numbered after the first's:
+// (shuffle v (3 2 1 0))
+// (shuffle a b (0 4 1 5))
+//
+ValueType EvaLLVM::genShuffle(const Exp& exp, Env env) {
+    if (exp.list.size() != 3 && exp.list.size() != 4) {
+        throw std::runtime_error("Invalid shuffle: " + exp2str(exp));
+    }
+    const auto& maskDecl = exp.list[exp.list.size() - 1];
+    auto        lhs = gen(exp.list[1], env).value;
+    auto rhs = exp.list.size() == 4 ? gen(exp.list[2], env).value : nullptr;
+    auto vectorType = llvm::dyn_cast<llvm::FixedVectorType>(lhs->getType());
+    if (vectorType == nullptr ||
+        (rhs != nullptr && rhs->getType() != vectorType)) {
+        throw std::runtime_error(
+            "Shuffle expects vectors of the same type: " + exp2str(exp));
+    }
+
+    // the mask is constant, so it's a single shuffle instruction
+    const int lanes = vectorType->getNumElements() * (rhs != nullptr ? 2 : 1);
+    std::vector<int> mask;
+    if (maskDecl.type == ExpType::LIST) {
+        for (const auto& index : maskDecl.list) {
+            if (index.type != ExpType::NUMBER ||
+                index.numberType != NumberType::I32 || index.number < 0 ||
+                index.number >= lanes) {
+                mask.clear();
+                break;
+            }
+            mask.push_back(index.number);
+        }
+    }
+    if (mask.empty()) {
+        throw std::runtime_error("Invalid shuffle mask: " + exp2str(maskDecl));
+    }
+
+    if (rhs == nullptr) {
+        return {builder->CreateShuffleVector(lhs, mask), nullptr};
+    }
+    return {builder->CreateShuffleVector(lhs, rhs, mask), nullptr};
+}
+
+// ----------------------------------------------------
+// Horizontal reduction of the lanes:
+// (reduce + v)
+// (reduce * v)
+// (reduce min v)
+// (reduce max v)
+//
+// The floating point sums and products are in the lanes order, --fast-math
+// allows to reassociate them
+ValueType EvaLLVM::genReduce(const Exp& exp, Env env) {
+    const auto& op = exp.list[1];
+    auto        vector = gen(exp.list[2], env).value;
+    auto vectorType = llvm::dyn_cast<llvm::FixedVectorType>(vector->getType());
+    if (vectorType == nullptr) {
+        throw std::runtime_error("Not a vector: " + exp2str(exp.list[2]));
+    }
+    const auto laneType = vectorType->getElementType();
+    const auto isFloat = laneType->isFloatingPointTy();
+
+    if (op.is(KW_ADD)) {
+        return {
+            isFloat ? builder->CreateFAddReduce(
+                          llvm::ConstantFP::getNegativeZero(laneType), vector)
+                    : builder->CreateAddReduce(vector),
+            nullptr};
+    } else if (op.is(KW_MUL)) {
+        return {
+            isFloat ? builder->CreateFMulReduce(
+                          llvm::ConstantFP::get(laneType, 1.0), vector)
+                    : builder->CreateMulReduce(vector),
+            nullptr};
+    } else if (op.type == ExpType::SYMBOL && op.string == "min") {
+        return {
+            isFloat ? builder->CreateFPMinReduce(vector)
+                    : builder->CreateIntMinReduce(vector, true),
+            nullptr};
+    } else if (op.type == ExpType::SYMBOL && op.string == "max") {
+        return {
+            isFloat ? builder->CreateFPMaxReduce(vector)
+                    : builder->CreateIntMaxReduce(vector, true),
+            nullptr};
+    }
+    throw std::runtime_error("Invalid reduction: " + exp2str(op));
+}
+
+// ----------------------------------------------------
+// Dynamic array, the elements are contiguous in a buffer on the GC heap:
+// (array f64)      -- empty
+// (array Point 10) -- 10 elements, zero or null
+//
+// The element type is declared as of a variable, e.g. number, f64, string,
+// a class, a vector or an array.
+ValueType EvaLLVM::genArray(const Exp& exp, Env env) {
+    if (exp.list.size() != 2 && exp.list.size() != 3) {
+        throw std::runtime_error("Invalid array: " + exp2str(exp));
+    }
+    const auto arrayType = getArrayType(exp);
+    const auto elementType = arrayElements_[arrayType].type;
+    auto       size = exp.list.size() == 3
+              ? castNumber(gen(exp.list[2], env).value, builder->getInt64Ty())
+              : builder->getInt64(0);
+    auto array = builder->CreateCall(
+        module->getFunction("eva_array_new"),
+        {size,
+         builder->getInt64(
+             module->getDataLayout().getTypeAllocSize(elementType)),
+         builder->getInt32(elementType->isPointerTy())},
+        "array");
+    return {array, arrayType};
+}
+
+// ----------------------------------------------------
+// Array element:
+// (at a i)
+//
+ValueType EvaLLVM::genAt(const Exp& exp, Env env) {
+    TypeType element;
+    auto     elementPtr = genElementPtr(exp, env, element);
+    auto     value = builder->CreateLoad(element.type, elementPtr, "at");
+    tagElementAccess(value, element.type);
+    return {value, element.ptrType};
+}
+
+// ----------------------------------------------------
+// Append to an array, the capacity doubles when it's full:
+// (push a x)
+//
+ValueType EvaLLVM::genPush(const Exp& exp, Env env) {
+    auto       array = gen(exp.list[1], env);
+    const auto arrayType = getArrayTypeOf(array, exp.list[1]);
+    const auto element = arrayElements_[arrayType];
+    auto       newValue = gen(exp.list[2], env);
+    auto       value = castNumber(newValue.value, element.type);
+    if (value->getType() != element.type) {
+        throw std::runtime_error("Invalid array element: " + exp2str(exp));
+    }
+
+    auto size = loadArrayField(arrayType, array.value, 0);
+    auto capacity = loadArrayField(arrayType, array.value, 1);
+    auto growBB = createBB("grow", fn);
+    auto pushBB = createBB("push", fn);
+    builder->CreateCondBr(
+        builder->CreateICmpEQ(size, capacity),
+        growBB,
+        pushBB,
+        llvm::MDBuilder(*context).createBranchWeights(1, 1000));
+
+    builder->SetInsertPoint(growBB);
+    builder->CreateCall(
+        module->getFunction("eva_array_grow"),
+        {array.value,
+         builder->getInt64(
+             module->getDataLayout().getTypeAllocSize(element.type)),
+         builder->getInt32(element.type->isPointerTy())});
+    builder->CreateBr(pushBB);
+
+    builder->SetInsertPoint(pushBB);
+    auto data = loadArrayField(arrayType, array.value, 2);
+    tagElementAccess(
+        builder->CreateStore(
+            value, builder->CreateInBoundsGEP(element.type, data, size)),
+        element.type);
+    storeArrayField(
+        arrayType,
+        array.value,
+        0,
+        builder->CreateAdd(size, builder->getInt64(1), "size", true, true));
+    return {value, newValue.type};
+}
+
+// ----------------------------------------------------
+// Number of elements of an array, an i64:
+// (len a)
+//
+ValueType EvaLLVM::genLen(const Exp& exp, Env env) {
+    auto array = gen(exp.list[1], env);
+    return {
+        loadArrayField(getArrayTypeOf(array, exp.list[1]), array.value, 0),
+        nullptr};
+}
+
+// ----------------------------------------------------
+// If statement:
+// (if (== x 42) (set x 100) (set x 200))
+//
+ValueType EvaLLVM::genIf(const Exp& exp, Env env) {
+    auto cond = gen(exp.list[1], env);
+    auto thenBB = createBB("then", fn);
+    auto elseBB = createBB("else", fn);
+    auto mergeBB = createBB("ifcont", fn);
+    builder->CreateCondBr(cond.value, thenBB, elseBB);
+
+    // then
+    builder->SetInsertPoint(thenBB);
+    auto thenVal = gen(exp.list[2], env);
+    builder->CreateBr(mergeBB);
+    thenBB = builder->GetInsertBlock();
+
+    // else
+    builder->SetInsertPoint(elseBB);
+    auto elseVal = gen(exp.list[3], env);
+    builder->CreateBr(mergeBB);
+    elseBB = builder->GetInsertBlock();
+
+    // the numbers of the branches are converted to their common type
+    const auto thenType = thenVal.value->getType();
+    const auto elseType = elseVal.value->getType();
+    if (thenType != elseType) {
+        const auto type = getCommonType(thenType, elseType);
+        builder->SetInsertPoint(thenBB->getTerminator());
+        thenVal.value = castNumber(thenVal.value, type);
+        builder->SetInsertPoint(elseBB->getTerminator());
+        elseVal.value = castNumber(elseVal.value, type);
+    }
+
+    // merge
+    builder->SetInsertPoint(mergeBB);
+
+    auto phi = builder->CreatePHI(thenVal.value->getType(), 2);
+    phi->addIncoming(thenVal.value, thenBB);
+    phi->addIncoming(elseVal.value, elseBB);
+    // return {builder->getInt32(0), nullptr};
+    return {phi, nullptr};
+}
+
+// ----------------------------------------------------
+// While loop
+// (while (< x 10) (set x (+ x 1)))
+//
+ValueType EvaLLVM::genWhile(const Exp& exp, Env env) {
+    EVA_TRACE(TRACE_GEN, "%*sWhile loop\n", traceIndent(), "");
+    auto condBB = createBB("cond", fn);
+    auto loopBB = createBB("loop", fn);
+    auto afterBB = createBB("afterloop", fn);
+    builder->CreateBr(condBB);
+
+    builder->SetInsertPoint(condBB);
+    auto cond = gen(exp.list[1], env);
+    builder->CreateCondBr(cond.value, loopBB, afterBB);
+
+    builder->SetInsertPoint(loopBB);
+    loops_.push_back({afterBB, condBB, regionDepth_});
+    auto body = gen(exp.list[2], env);
+    loops_.pop_back();
+    builder->CreateBr(condBB);
+
+    builder->SetInsertPoint(afterBB);
+
+    EVA_TRACE(TRACE_GEN, "%*sWhile loop end\n", traceIndent(), "");
+    return {builder->getInt32(0), nullptr};
+}
+
+// ----------------------------------------------------
+// Counted loop, the variable goes from the start up to the end excluded, the
+// end and the step are evaluated once. The step is 1 by default, a negative
+// one counts down to the end:
+// (for (i 0 10) (printf "%d\n" i))
+// (for (i 10 0 (- 0 2)) (printf "%d\n" i))
+//
+// The hints go before the body:
+// (for (i 0 n) (unroll 4) (vectorize 8) (set (at a i) 0))
+//
+// Parallel loop, the array elements don't depend on the other iterations, so
+// they're vectorized without the runtime checks and the reductions are
+// reordered:
+// (parallel-for (i 0 (len a)) (set (at a i) (* (at a i) 2)))
+//
+ValueType EvaLLVM::genFor(const Exp& exp, Env env) {
+    if (exp.list.size() < 3 || exp.list[1].type != ExpType::LIST ||
+        exp.list[1].list.size() < 3 || exp.list[1].list.size() > 4 ||
+        exp.list[1].list[0].type != ExpType::SYMBOL) {
+        throw std::runtime_error("Invalid for loop: " + exp2str(exp));
+    }
+    EVA_TRACE(TRACE_GEN, "%*sFor loop\n", traceIndent(), "");
+    const auto& header = exp.list[1].list;
+    const auto  varName = std::string(header[0].string);
+
+    // the variable has the common type of the bounds and the step
+    auto start = gen(header[1], env).value;
+    auto end = gen(header[2], env).value;
+    auto step =
+        header.size() == 4 ? gen(header[3], env).value : builder->getInt32(1);
+    const auto type = getCommonType(
+        getCommonType(start->getType(), end->getType()), step->getType());
+    if (!type->isIntegerTy() || type->isIntegerTy(1)) {
+        throw std::runtime_error(
+            "The bounds of a for loop must be numbers: " + exp2str(exp));
+    }
+    start = castNumber(start, type);
+    end = castNumber(end, type);
+    step = castNumber(step, type);
+
+    // the variable can't overflow when it moves by one towards the end
+    const auto constStep = llvm::dyn_cast<llvm::ConstantInt>(step);
+    if (constStep != nullptr && constStep->isZero()) {
+        throw std::runtime_error(
+            "The step of a for loop is 0: " + exp2str(exp));
+    }
+    const auto down = constStep != nullptr && constStep->isNegative();
+    const auto unitStep =
+        constStep != nullptr && (constStep->isOne() || constStep->isMinusOne());
+
+    auto preheaderBB = builder->GetInsertBlock();
+    auto headerBB = createBB("for", fn);
+    auto bodyBB = createBB("forbody", fn);
+    auto latchBB = createBB("forstep", fn);
+    auto afterBB = createBB("afterfor", fn);
+    builder->CreateBr(headerBB);
+
+    builder->SetInsertPoint(headerBB);
+    auto var = builder->CreatePHI(type, 2, varName);
+    var->addIncoming(start, preheaderBB);
+    llvm::Value* cond = nullptr;
+    if (constStep != nullptr) {
+        cond = down ? builder->CreateICmpSGT(var, end)
+                    : builder->CreateICmpSLT(var, end);
+    } else {
+        // the direction is known at run time, the loop is unswitched on it
+        cond = builder->CreateSelect(
+            builder->CreateICmpSLT(step, llvm::ConstantInt::get(type, 0)),
+            builder->CreateICmpSGT(var, end),
+            builder->CreateICmpSLT(var, end));
+    }
+    builder->CreateCondBr(cond, bodyBB, afterBB);
+
+    // the body sees the variable as a value, it can't be set
+    builder->SetInsertPoint(bodyBB);
+    auto forEnv =
+        std::make_shared<Environment>(std::map<std::string, ValueType>{}, env);
+    forEnv->define(varName, var, nullptr);
+    llvm::MDNode* accessGroup = nullptr;
+    if (exp.list[0].is(KW_PARALLEL_FOR)) {
+        accessGroup = llvm::MDNode::getDistinct(*context, {});
+        accessGroups_.push_back(accessGroup);
+    }
+    loops_.push_back({afterBB, latchBB, regionDepth_});
+    gen(exp.list[exp.list.size() - 1], forEnv);
+    loops_.pop_back();
+    if (accessGroup != nullptr) {
+        accessGroups_.pop_back();
+    }
+    builder->CreateBr(latchBB);
+
+    builder->SetInsertPoint(latchBB);
+    auto next =
+        builder->CreateAdd(var, step, varName + ".next", false, unitStep);
+    var->addIncoming(next, latchBB);
+    builder->CreateBr(headerBB)->setMetadata(
+        llvm::LLVMContext::MD_loop,
+        getLoopMetadata(exp, constStep, accessGroup));
+
+    builder->SetInsertPoint(afterBB);
+
+    EVA_TRACE(TRACE_GEN, "%*sFor loop end\n", traceIndent(), "");
+    return {builder->getInt32(0), nullptr};
+}
+
+// ----------------------------------------------------
+// Leave the innermost loop, or go to its next iteration:
+// (break)
+// (continue)
+//
+// The code after the jump is unreachable, it goes to a block without
+// predecessors.
+//
+ValueType EvaLLVM::genBreak(const Exp& exp, Env env) {
+    if (loops_.empty()) {
+        throw std::runtime_error("Not in a loop: " + exp2str(exp));
+    }
+    const auto& loop = loops_.back();
+    if (loop.regionDepth != regionDepth_) {
+        throw std::runtime_error(
+            "Can't jump out of a region: " + exp2str(exp));
+    }
+    builder->CreateBr(
+        exp.list[0].is(KW_BREAK) ? loop.breakBB : loop.continueBB);
+    builder->SetInsertPoint(createBB("afterjump", fn));
+    return {builder->getInt32(0), nullptr};
+}
+
+// ----------------------------------------------------
+// Function definition
+// Untyped:
+//   (def square (x) (* x x))
+// Typed:
+//   (def sum ((a number) (b number)) -> number (+ a b))
+//
+ValueType EvaLLVM::genDef(const Exp& exp, Env env) {
+    auto fnName = symbolName(exp.list[1]);
+    if (classType != nullptr) {
+        fnName = classType->getName().str() + "_" + fnName;
+    }
+
+    auto argTypes = getArgTypes(exp);
+    auto argNames = getArgNames(exp);
+    auto retType = getRetType(exp);
+
+    // store insertion point
+    auto currentBlock = builder->GetInsertBlock();
+    auto currentFn = fn;
+
+    // the function may be called in a region, it's only known at run time
+    const auto currentRegionDepth = regionDepth_;
+    const auto currentMaybeInRegion = maybeInRegion_;
+    regionDepth_ = 0;
+    maybeInRegion_ = usesRegions_;
+
+    // break and continue don't leave the function
+    auto currentLoops = std::exchange(loops_, {});
+    auto currentAccessGroups = std::exchange(accessGroups_, {});
+
+    // the calls in the tail position don't need a new stack frame
+    const auto& fnBody = exp.list.size() == 6 ? exp.list[5] : exp.list[3];
+    auto        currentTailCalls = std::exchange(tailCalls_, {});
+    collectTailExps(fnBody, tailCalls_.exps);
+    const auto selfTailCall = classType == nullptr &&
+        std::any_of(tailCalls_.exps.begin(),
+                    tailCalls_.exps.end(),
+                    [&](const Exp* tailExp) {
+                        return tailExp->type == ExpType::LIST &&
+                            !tailExp->list.empty() &&
+                            tailExp->list[0].type == ExpType::SYMBOL &&
+                            tailExp->list[0].string == exp.list[1].string;
+                    });
+
+    fn = createFunction(
+        fnName, llvm::FunctionType::get(retType, argTypes, false), env);
+    auto fnEnv =
+        std::make_shared<Environment>(std::map<std::string, ValueType>{}, env);
+    auto fnArgs = fn->arg_begin();
+    for (size_t i = 0; i < argNames.size(); i++) {
+        auto argName = argNames[i];
+        EVA_TRACE(
+            TRACE_FUNC,
+            "%*sParsing args: %s, class %s\n",
+            traceIndent(),
+            "",
+            argName.c_str(),
+            dumpValueToString(argTypes[i]).c_str());
+        fnArgs[i].setName(argName);
+        // store the argument in the function environment, the typed ones
+        // keep their class or array type, the strings are i8 as the literals
+        const auto& argDecl = exp.list[2].list[i];
+        auto        argClassType = argDecl.type == ExpType::LIST
+                   ? extractVarType(argDecl).ptrType
+                   : classType;
+        if (argClassType == nullptr && argTypes[i]->isPointerTy()) {
+            argClassType = builder->getInt8Ty();
+        }
+        fnEnv->define(argName, &fnArgs[i], argClassType);
+        // initialize the argument
+        auto arg = allocVar(argName, argTypes[i], fnEnv);
+        builder->CreateStore(&fnArgs[i], arg);
+        // the self tail calls assign the arguments, they keep the class or
+        // array type too
+        if (selfTailCall) {
+            fnEnv->define(
+                argName, arg, argClassType ? argClassType : argTypes[i]);
+            tailCalls_.args.push_back(arg);
+        }
+    }
+    if (selfTailCall) {
+        tailCalls_.loop = createBB("tailrecurse", fn);
+        builder->CreateBr(tailCalls_.loop);
+        builder->SetInsertPoint(tailCalls_.loop);
+    }
+    auto ret = gen(fnBody, fnEnv);
+    builder->CreateRet(castNumber(ret.value, retType));
+
+    auto typeStr = dumpValueToString(fn->getFunctionType());
+    EVA_TRACE(
+        TRACE_FUNC,
+        "%*sFunction defined: %s %s\n",
+        traceIndent(),
+        "",
+        fnName.c_str(),
+        typeStr.c_str());
+    // restore insertion point, there is none outside of main in the
+    // parallel partitions
+    if (currentBlock != nullptr) {
+        builder->SetInsertPoint(currentBlock);
+    } else {
+        builder->ClearInsertionPoint();
+    }
+    fn = currentFn;
+    regionDepth_ = currentRegionDepth;
+    maybeInRegion_ = currentMaybeInRegion;
+    tailCalls_ = std::move(currentTailCalls);
+    loops_ = std::move(currentLoops);
+    accessGroups_ = std::move(currentAccessGroups);
+    if (classType == nullptr) {
+        registerDef(exp);
+    }
+
+    return {fn, nullptr};
+}
+
+// ----------------------------------------------------
+// Class definition
+// (class Point null
+//   (begin
+//     (var x 0)
+//     (var y 0)
+//
+//     ...
+//   )
+// )
+ValueType EvaLLVM::genClass(const Exp& exp, Env env) {
+    createClass(exp, env);
+    return {builder->getInt32(0), nullptr};
+}
+
+// ----------------------------------------------------
+// Property access getter
+// (prop Point p x)
+ValueType EvaLLVM::genProp(const Exp& exp, Env env) {
+    return accessProperty(exp, env);
+}
+
+// ----------------------------------------------------
+// Method / super call
+// (method p calc)
+// (method (self Point) calc)
+ValueType EvaLLVM::genMethod(const Exp& exp, Env env) {
+    if (exp.list.size() < 3 ||
+        (exp.list[1].type != ExpType::SYMBOL &&
+         (exp.list[1].type != ExpType::LIST || exp.list[1].list.size() != 2))) {
+        throw std::runtime_error("Invalid method call: " + exp2str(exp));
+    }
+    const auto& instExp =
+        exp.list[1].type == ExpType::SYMBOL ? exp.list[1] : exp.list[1].list[0];
+    std::string specifiedType;
+    if (exp.list[1].type != ExpType::SYMBOL) {
+        specifiedType = symbolName(exp.list[1].list[1]);
+    }
+    auto methodName = symbolName(exp.list[2]);
+    auto inst = gen(instExp, env);
+    // original class name
+    auto className = inst.type->getStructName().str();
+    EVA_TRACE(
+        TRACE_CLASS,
+        "%*sClass name: %s\n",
+        traceIndent(),
+        "",
+        className.c_str());
+    if (!specifiedType.empty()) {
+        className = specifiedType;
+    }
+    EVA_TRACE(
+        TRACE_CLASS,
+        "%*sSpecified class name: %s\n",
+        traceIndent(),
+        "",
+        className.c_str());
+
+    auto         funcName = className + "_" + methodName;
+    auto&        classInfo = classMap_[className];
+    llvm::Value* fnDest = nullptr;
+    // we're only using vtable if outside of a class, we must use
+    // direct function call inside of a class
+    if (classType == nullptr) {
+        EVA_TRACE(
+            TRACE_CLASS,
+            "%*sMethod call outside of class: %s.%s\n",
+            traceIndent(),
+            "",
+            className.c_str(),
+            methodName.c_str());
+        fnDest = devirtualize(className, methodName);
+        if (fnDest == nullptr) {
+            fnDest = loadVtablePtr(inst.value, methodName, className);
+        }
+    } else {
+        fnDest = getFunctionBySymbol(parser->symbols.intern(funcName));
+    }
+
+    if (fnDest == nullptr) {
+        auto e = "Method not found: " + funcName;
+        throw std::runtime_error(e.c_str());
+    }
+    EVA_TRACE(
+        TRACE_CLASS,
+        "%*sCalling method: %s\n",
+        traceIndent(),
+        "",
+        funcName.c_str());
+
+    return {
+        builder->CreateCall(
+            classInfo.methodTypes[methodName]->getFunctionType(),
+            fnDest,
+            genMethodArgs(
+                inst.value,
+                exp,
+                3,
+                env,
+                classInfo.methodTypes[methodName]->getFunctionType())),
+        nullptr};
+}
+
+// ----------------------------------------------------
+// Function call
+// (square 2)
+//
+// Functor call
+// (transform 10) // where transform is a class with __call__ method
+ValueType EvaLLVM::genCall(const Exp& exp, Env env) {
+    const auto& tag = exp.list[0];
+
+    // try to find the function by the symbol
+    auto fn = getFunctionBySymbol(tag.symbol);
+    if (fn) {
+        EVA_TRACE(
+            TRACE_FUNC,
+            "%*sFunction found: %s\n",
+            traceIndent(),
+            "",
+            std::string(tag.string).c_str());
+        auto args = genFunctionArgs(exp, 1, env, fn->getFunctionType());
+        if (options_.optLevel > 0) {
+            if (auto value = foldPureCall(exp, fn, args)) {
+                return {value, nullptr};
+            }
+        }
+        if (tailCalls_.exps.count(&exp)) {
+            return genTailCall(fn, args);
+        }
+        return {builder->CreateCall(fn, args), nullptr};
+    }
+
+    const auto tagName = symbolName(tag);
+    EVA_TRACE(
+        TRACE_FUNC,
+        "%*sFunction not found: %s\n",
+        traceIndent(),
+        "",
+        tagName.c_str());
+
+    auto callable = getCallable(exp, env);
+    if (callable != nullptr) {
+        EVA_TRACE(
+            TRACE_FUNC,
+            "%*sCalling a functor/callable: %s\n",
+            traceIndent(),
+            "",
+            tagName.c_str());
+        const auto   classInfo = getClassInfoByVarName(tagName, env);
+        const auto   className = classInfo->classType->getStructName().str();
+        llvm::Value* fnDest = devirtualize(className, "__call__");
+        if (fnDest == nullptr) {
+            fnDest = loadVtablePtr(callable, "__call__", className);
+        }
+        return {
+            builder->CreateCall(
+                classInfo->methodTypes["__call__"]->getFunctionType(),
+                fnDest,
+                genMethodArgs(
+                    callable,
+                    exp,
+                    1,
+                    env,
+                    classInfo->methodTypes["__call__"]->getFunctionType())),
+            nullptr};
+    }
+    EVA_TRACE(
+        TRACE_FUNC,
+        "%*sCallable not found: %s\n",
+        traceIndent(),
+        "",
+        tagName.c_str());
+    return {nullptr, nullptr};
+}
+
+/**
+ * Call in the tail position of the function. A self call jumps back to the
+ * start of the function with the new arguments, a call of a function with
+ * the same prototype reuses the stack frame (musttail), the rest are only
+ * marked for the backend. The code after the jump or the return is
+ * unreachable, it goes to a block without predecessors.
+ */
+ValueType EvaLLVM::genTailCall(
+    llvm::Function* callee, const std::vector<llvm::Value*>& args) {
+    if (callee == fn && tailCalls_.loop != nullptr) {
+        for (size_t i = 0; i < args.size(); i++) {
+            builder->CreateStore(args[i], tailCalls_.args[i]);
+        }
+        builder->CreateBr(tailCalls_.loop);
+    } else if (callee->getFunctionType() == fn->getFunctionType()) {
+        auto call = builder->CreateCall(callee, args);
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        builder->CreateRet(call);
+    } else {
+        auto call = builder->CreateCall(callee, args);
+        call->setTailCallKind(llvm::CallInst::TCK_Tail);
+        return {call, nullptr};
+    }
+    builder->SetInsertPoint(createBB("aftertail", fn));
+    return {llvm::PoisonValue::get(fn->getReturnType()), nullptr};
+}
+
+/**
+ * Budget of the compile-time evaluation of a call with constant arguments,
+ * and of a const-eval, which fails without it
+ */
+static constexpr size_t   constEvalCallSteps = 1 << 16;
+static constexpr size_t   constEvalFormSteps = 1 << 24;
+static constexpr unsigned constEvalMaxDepth = 256;
+
+/**
+ * A break or a continue evaluated at compile time, it unwinds to the
+ * innermost loop
+ */
+struct ConstJump {
+    bool isBreak;
+};
+
+/**
+ * Check the result of an operation evaluated at compile time is a number, an
+ * undefined one (e.g. a division by zero) is poison
+ */
+static llvm::Constant* checkConst(llvm::Value* value, const Exp& exp) {
+    if (!llvm::isa<llvm::ConstantInt>(value) &&
+        !llvm::isa<llvm::ConstantFP>(value)) {
+        throw std::runtime_error("undefined result: " + exp2str(exp));
+    }
+    return llvm::cast<llvm::Constant>(value);
+}
+
+// ----------------------------------------------------
+// Compile-time evaluation, the expression can only compute numbers and call
+// the pure functions, it's an error if it can't be evaluated:
+// (const-eval (fib 20))
+//
+ValueType EvaLLVM::genConstEval(const Exp& exp, Env env) {
+    if (exp.list.size() != 2) {
+        throw std::runtime_error("Invalid const-eval: " + exp2str(exp));
+    }
+    constEvalSteps_ = constEvalFormSteps;
+    constEvalDepth_ = 0;
+    constEvalLoops_ = 0;
+    ConstScope      scope;
+    llvm::Constant* value = nullptr;
+    try {
+        value = evalConst(exp.list[1], scope);
+        if (value == nullptr) {
+            throw std::runtime_error("not a number");
+        }
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(
+            "Can't evaluate at compile time: " + exp2str(exp.list[1]) + ", " +
+            e.what());
+    }
+    reportConstEval(exp.list[1], value);
+    return {value, nullptr};
+}
+
+/**
+ * Keep the definition of a top-level function for the compile-time
+ * evaluation, a REPL redefinition may change the purity of its callers
+ */
+void EvaLLVM::registerDef(const Exp& exp) {
+    defExps_[std::string(exp.list[1].string)] = &exp;
+    pureFunctions_.clear();
+}
+
+/**
+ * Check a top-level function is pure: its arguments and result are numbers
+ * and its body has no effects. It's assumed pure while its body is checked,
+ * for the recursive calls.
+ */
+bool EvaLLVM::isPureFunction(const std::string& name) {
+    auto known = pureFunctions_.find(name);
+    if (known != pureFunctions_.end()) {
+        return known->second;
+    }
+    auto def = defExps_.find(name);
+    if (def == defExps_.end()) {
+        return false;
+    }
+    const auto& exp = *def->second;
+    pureFunctions_[name] = true;
+
+    auto                  pure = exp.list[2].type == ExpType::LIST;
+    std::set<std::string> names;
+    for (size_t i = 0; pure && i < exp.list[2].list.size(); i++) {
+        const auto& arg = exp.list[2].list[i];
+        pure = arg.type == ExpType::SYMBOL ||
+            (arg.type == ExpType::LIST && arg.list.size() == 2 &&
+             isNumberType(arg.list[1]));
+        names.insert(extractVarName(arg));
+    }
+    if (exp.list.size() == 6) {
+        pure = pure && isNumberType(exp.list[4]);
+    }
+    pure = pure &&
+        isPureExp(exp.list.size() == 6 ? exp.list[5] : exp.list[3], names);
+
+    // the functions checked meanwhile may have assumed it's pure
+    if (!pure) {
+        pureFunctions_.clear();
+    }
+    pureFunctions_[name] = pure;
+    return pure;
+}
+
+/**
+ * Check an expression has no effects: it only computes numbers of its
+ * variables and calls the pure functions. The names are the variables
+ * declared so far.
+ */
+bool EvaLLVM::isPureExp(const Exp& exp, std::set<std::string>& names) {
+    switch (exp.type) {
+    case ExpType::NUMBER:
+        return true;
+    case ExpType::STRING:
+        return false;
+    case ExpType::SYMBOL:
+        return exp.is(KW_TRUE) || exp.is(KW_FALSE) ||
+            names.count(std::string(exp.string)) != 0;
+    case ExpType::LIST:
+        break;
+    }
+    if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL) {
+        return false;
+    }
+    auto operandsArePure = [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; i++) {
+            if (!isPureExp(exp.list[i], names)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    switch (exp.list[0].symbol) {
+    case KW_VAR: {
+        const auto& decl = exp.list[1];
+        if (exp.list.size() != 3 ||
+            (decl.type == ExpType::LIST &&
+             (decl.list.size() != 2 || !isNumberType(decl.list[1]))) ||
+            !isPureExp(exp.list[2], names)) {
+            return false;
+        }
+        names.insert(extractVarName(decl));
+        return true;
+    }
+    case KW_SET:
+        return exp.list.size() == 3 && exp.list[1].type == ExpType::SYMBOL &&
+            names.count(std::string(exp.list[1].string)) != 0 &&
+            isPureExp(exp.list[2], names);
+    case KW_FOR:
+    case KW_PARALLEL_FOR: {
+        // the hints between the header and the body aren't evaluated
+        const auto& header = exp.list[1];
+        if (exp.list.size() < 3 || header.type != ExpType::LIST ||
+            header.list.size() < 3 || header.list.size() > 4 ||
+            header.list[0].type != ExpType::SYMBOL) {
+            return false;
+        }
+        for (size_t i = 1; i < header.list.size(); i++) {
+            if (!isPureExp(header.list[i], names)) {
+                return false;
+            }
+        }
+        names.insert(std::string(header.list[0].string));
+        return isPureExp(exp.list[exp.list.size() - 1], names);
+    }
+    case KW_BEGIN:
+    case KW_IF:
+    case KW_WHILE:
+    case KW_BREAK:
+    case KW_CONTINUE:
+    case KW_ADD:
+    case KW_SUB:
+    case KW_MUL:
+    case KW_DIV:
+    case KW_EQ:
+    case KW_NE:
+    case KW_LT:
+    case KW_LE:
+    case KW_GT:
+    case KW_GE:
+        return operandsArePure(1, exp.list.size());
+    }
+    return exp.list[0].symbol >= KEYWORDS_COUNT &&
+        isPureFunction(std::string(exp.list[0].string)) &&
+        operandsArePure(1, exp.list.size());
+}
+
+/**
+ * Fold a call of a pure function with constant arguments into its result,
+ * nullptr if it can't be evaluated in the budget
  */
-ValueType EvaLLVM::gen(const Exp& exp, Env env) {
+llvm::Constant* EvaLLVM::foldPureCall(
+    const Exp&                       exp,
+    llvm::Function*                  callee,
+    const std::vector<llvm::Value*>& args) {
+    const auto name = std::string(exp.list[0].string);
+    if (!isPureFunction(name)) {
+        return nullptr;
+    }
+    std::vector<llvm::Constant*> constArgs;
+    for (auto arg : args) {
+        if (!llvm::isa<llvm::ConstantInt>(arg) &&
+            !llvm::isa<llvm::ConstantFP>(arg)) {
+            return nullptr;
+        }
+        constArgs.push_back(llvm::cast<llvm::Constant>(arg));
+    }
 
-    static size_t spaces = 0;
+    constEvalSteps_ = constEvalCallSteps;
+    constEvalDepth_ = 0;
+    constEvalLoops_ = 0;
+    try {
+        auto value = evalConstCall(*defExps_[name], callee, constArgs);
+        reportConstEval(exp, value);
+        return value;
+    } catch (const std::runtime_error& e) {
+        EVA_TRACE(
+            TRACE_FUNC,
+            "%*sNot evaluated at compile time: %s, %s\n",
+            traceIndent(),
+            "",
+            exp2str(exp).c_str(),
+            e.what());
+        return nullptr;
+    }
+}
 
-    ValueType   result{nullptr, nullptr};
-    std::string indent(spaces, ' ');
-    dprintf("%sgen: %s\n", indent.c_str(), exp2str(exp).c_str());
-    spaces += 2;
+/**
+ * Evaluate an expression at compile time. The operations are the ones of the
+ * generated code, the builder folds them, so the results are the same as at
+ * run time. It throws for the effects and the unknown values, and when the
+ * budget runs out. A var has no value, it's nullptr.
+ */
+llvm::Constant* EvaLLVM::evalConst(const Exp& exp, ConstScope& scope) {
+    if (constEvalSteps_ == 0) {
+        throw std::runtime_error("too many steps");
+    }
+    constEvalSteps_--;
+    auto evalNumber = [&](const Exp& operand, ConstScope& operandScope) {
+        auto value = evalConst(operand, operandScope);
+        if (value == nullptr) {
+            throw std::runtime_error("not a number: " + exp2str(operand));
+        }
+        return checkConst(value, operand);
+    };
 
     switch (exp.type) {
-
     case ExpType::NUMBER:
-        result = {builder->getInt32(exp.number), nullptr};
-        break;
-
-    case ExpType::STRING: {
-        // handle \\n
-        auto re = std::regex("\\\\n");
-        auto str = std::regex_replace(exp.string, re, "\n");
-        result = {builder->CreateGlobalStringPtr(str), builder->getInt8Ty()};
-        break;
-    }
-
+        return llvm::cast<llvm::Constant>(gen(exp, nullptr).value);
+    case ExpType::STRING:
+        throw std::runtime_error("not a number: " + exp2str(exp));
     case ExpType::SYMBOL: {
-        /**
-         * Boolean
-         */
-        if (exp.string == "true") {
-            result = {builder->getInt1(true), nullptr};
-            break;
-        } else if (exp.string == "false") {
-            result = {builder->getInt1(false), nullptr};
+        if (exp.is(KW_TRUE)) {
+            return builder->getTrue();
+        } else if (exp.is(KW_FALSE)) {
+            return builder->getFalse();
         }
-
-        // printf("Calling a function: %s\n", exp.string.c_str());
-        auto fn = module->getFunction(exp.string);
-        if (fn != nullptr) {
-            dprintf(
-                "%sFunction found: %s\n", indent.c_str(), exp.string.c_str());
-            result = {builder->CreateCall(fn), nullptr};
-            break;
+        const auto name = std::string(exp.string);
+        auto       varScope = scope.find(name);
+        if (varScope == nullptr) {
+            throw std::runtime_error("not a local variable: " + name);
         }
+        return varScope->vars[name];
+    }
+    case ExpType::LIST:
+        break;
+    }
+    if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL) {
+        throw std::runtime_error("not evaluated: " + exp2str(exp));
+    }
 
-        // Variables:
-        // printf("Looking up variable: %s\n", exp.string.c_str());
-        auto varName = exp.string;
-        // cast to stack allocated value: AllocaInst
-        auto var = env->lookup(varName);
-        auto varAlloca = llvm::dyn_cast<llvm::AllocaInst>(var.value);
-        // 1. Local variables:
-        if (varAlloca != nullptr) {
-            dprintf(
-                "%sVariable found (AllocaInst): %s\n",
-                indent.c_str(),
-                varName.c_str());
-            result = {
-                builder->CreateLoad(
-                    varAlloca->getAllocatedType(), varAlloca, varName.c_str()),
-                var.type};
-            break;
+    const auto op = exp.list[0].symbol;
+    switch (op) {
+    case KW_BEGIN: {
+        ConstScope      block{{}, &scope};
+        llvm::Constant* result = nullptr;
+        for (size_t i = 1; i < exp.list.size(); i++) {
+            result = evalConst(exp.list[i], block);
         }
-
-        // last resort: variables
-        if (var.value) {
-            dprintf(
-                "%sVariable found: %s, orig type %s\n",
-                indent.c_str(),
-                varName.c_str(),
-                dumpValueToString(var.type).c_str());
-            result = var;
-            break;
+        return result;
+    }
+    case KW_VAR: {
+        const auto& decl = exp.list[1];
+        auto        value = evalNumber(exp.list[2], scope);
+        if (decl.type == ExpType::LIST) {
+            if (!isNumberType(decl.list[1])) {
+                throw std::runtime_error("not a number: " + exp2str(decl));
+            }
+            value = checkConst(
+                castNumber(value, extractVarType(decl).type), exp);
         }
-
-        throw std::runtime_error("Symbol not implemented");
+        scope.vars[extractVarName(decl)] = value;
+        return nullptr;
     }
-    case ExpType::LIST: {
-        if (exp.list.empty()) {
-            throw std::runtime_error("Empty list");
+    case KW_SET: {
+        auto value = evalNumber(exp.list[2], scope);
+        auto name = exp.list[1].type == ExpType::SYMBOL
+            ? std::string(exp.list[1].string)
+            : std::string();
+        auto varScope = scope.find(name);
+        if (varScope == nullptr || varScope->loopVar == name) {
+            throw std::runtime_error("not assignable: " + exp2str(exp));
         }
-
-        const auto tag = exp.list[0];
-        if (tag.type == ExpType::SYMBOL) {
-
-            // ----------------------------------------------------
-            // printf extern function:
-            //
-            // (printf "value %d" 42)
-            //
-            //
-            if (tag.string == "printf") {
-
-                const auto printfFn = module->getFunction("printf");
-                assert(printfFn && "Function 'printf' not found");
-
-                std::vector<llvm::Value*> args;
-
-                for (size_t i = 1; i < exp.list.size(); i++) {
-                    args.push_back(gen(exp.list[i], env).value);
-                }
-
-                result = {builder->CreateCall(printfFn, args), nullptr};
+        value = checkConst(
+            castNumber(value, varScope->vars[name]->getType()), exp);
+        varScope->vars[name] = value;
+        return value;
+    }
+    case KW_ADD:
+    case KW_SUB:
+    case KW_MUL:
+    case KW_DIV: {
+        auto lhs = evalNumber(exp.list[1], scope);
+        auto rhs = evalNumber(exp.list[2], scope);
+        return checkConst(createArithmetic(op, lhs, rhs), exp);
+    }
+    case KW_EQ:
+    case KW_NE:
+    case KW_LT:
+    case KW_LE:
+    case KW_GT:
+    case KW_GE: {
+        auto lhs = evalNumber(exp.list[1], scope);
+        auto rhs = evalNumber(exp.list[2], scope);
+        return checkConst(createComparison(op, lhs, rhs), exp);
+    }
+    case KW_IF: {
+        auto cond = evalNumber(exp.list[1], scope);
+        if (!cond->getType()->isIntegerTy(1)) {
+            throw std::runtime_error("not a condition: " + exp2str(exp));
+        }
+        const auto& taken = cond->isOneValue() ? exp.list[2] : exp.list[3];
+        const auto& other = cond->isOneValue() ? exp.list[3] : exp.list[2];
+        auto        value = evalNumber(taken, scope);
+        // the branches are converted to their common type
+        ConstScope otherScope{{}, &scope};
+        auto       otherType = inferConstType(other, otherScope);
+        if (otherType == nullptr) {
+            throw std::runtime_error("not a number: " + exp2str(other));
+        }
+        return checkConst(
+            castNumber(value, getCommonType(value->getType(), otherType)),
+            exp);
+    }
+    case KW_WHILE: {
+        constEvalLoops_++;
+        for (;;) {
+            auto cond = evalNumber(exp.list[1], scope);
+            if (!cond->getType()->isIntegerTy(1)) {
+                throw std::runtime_error("not a condition: " + exp2str(exp));
+            }
+            if (cond->isZeroValue()) {
                 break;
             }
-
-            // ----------------------------------------------------
-            // Variable delcaration: (var x (+ y 10))
-            //
-            // Typed: (var (x number) 42)
-            // Derived type: ( var x ( prop self cell ) ) // Cell type
-            //
-            // Note: locals are allocated on the stack
-            else if (tag.string == "var") {
-                auto varNameDecl = exp.list[1];
-                auto varInitDecl = exp.list[2];
-                auto varName = extractVarName(varNameDecl);
-                dprintf(
-                    "%sVariable declaration: %s\n",
-                    indent.c_str(),
-                    varName.c_str());
-
-                // Class instance creation
-                // (var p (new Point 1 2))
-                if (varInitDecl.type == ExpType::LIST &&
-                    varInitDecl.list[0].string == "new") {
-                    result = {
-                        createClassInstance(varInitDecl, env, varName),
-                        classMap_[varInitDecl.list[0].string].classType};
+            try {
+                evalConst(exp.list[2], scope);
+            } catch (const ConstJump& jump) {
+                if (jump.isBreak) {
                     break;
                 }
-
-                // initializer
-                auto genValueType = gen(varInitDecl, env);
-                dprintf(
-                    "%sgen result: %s\n",
-                    indent.c_str(),
-                    dumpValueToString(genValueType.value).c_str());
-                dprintf(
-                    "%sgen type ptr: %s\n",
-                    indent.c_str(),
-                    dumpValueToString(genValueType.type).c_str());
-
-                // variable
-                auto varBinding =
-                    allocVar(varName, genValueType.value->getType(), env);
-                const auto definedType = genValueType.type == nullptr
-                    ? genValueType.value->getType()
-                    : genValueType.type;
-                env->define(varName, varBinding, definedType);
-                dprintf(
-                    "%sVariable binding: %s\n",
-                    indent.c_str(),
-                    dumpValueToString(varBinding).c_str());
-
-                // set value
-                assert(varBinding && "Variable not found");
-                builder->CreateStore(genValueType.value, varBinding);
-                result = {varBinding, genValueType.type};
-                break;
-
             }
-            // ----------------------------------------------------
-            // Block:
-            // (begin <exp1> <exp2> ... <expN>)
-            //
-            else if (tag.string == "begin") {
-
-                // create new environment
-                auto record = std::map<std::string, ValueType>{};
-                auto newEnv = std::make_shared<Environment>(record, env);
-
-                for (size_t i = 1; i < exp.list.size(); i++) {
-                    result = gen(exp.list[i], newEnv);
-                }
+        }
+        constEvalLoops_--;
+        return builder->getInt32(0);
+    }
+    case KW_FOR:
+    case KW_PARALLEL_FOR: {
+        const auto& header = exp.list[1];
+        if (exp.list.size() < 3 || header.type != ExpType::LIST ||
+            header.list.size() < 3 || header.list.size() > 4 ||
+            header.list[0].type != ExpType::SYMBOL) {
+            throw std::runtime_error("Invalid for loop: " + exp2str(exp));
+        }
+        auto start = evalNumber(header.list[1], scope);
+        auto end = evalNumber(header.list[2], scope);
+        llvm::Constant* step = header.list.size() == 4
+            ? evalNumber(header.list[3], scope)
+            : builder->getInt32(1);
+        const auto type = getCommonType(
+            getCommonType(start->getType(), end->getType()), step->getType());
+        if (!type->isIntegerTy() || type->isIntegerTy(1)) {
+            throw std::runtime_error("not a counted loop: " + exp2str(exp));
+        }
+        start = checkConst(castNumber(start, type), exp);
+        end = checkConst(castNumber(end, type), exp);
+        step = checkConst(castNumber(step, type), exp);
+        const auto down = llvm::cast<llvm::ConstantInt>(step)->isNegative();
+
+        ConstScope loop{{}, &scope, std::string(header.list[0].string)};
+        constEvalLoops_++;
+        for (auto var = start;;) {
+            auto inRange = createComparison(down ? KW_GT : KW_LT, var, end);
+            if (llvm::cast<llvm::ConstantInt>(inRange)->isZero()) {
                 break;
             }
-            // ----------------------------------------------------
-            // set:
-            // (set x 42)
-            // (set (x string) "Hello, World!")
-            //
-            // Class property access:
-            // (set (prop self Point x) x)
-            else if (tag.string == "set") {
-
-                // if it's a property access, call the setter
-                if (exp.list[1].type == ExpType::LIST &&
-                    exp.list[1].list[0].string == "prop") {
-                    auto newValue = gen(exp.list[2], env);
-                    result = {
-                        accessProperty(exp.list[1], env, newValue.value).value,
-                        newValue.type};
+            loop.vars[loop.loopVar] = var;
+            try {
+                evalConst(exp.list[exp.list.size() - 1], loop);
+            } catch (const ConstJump& jump) {
+                if (jump.isBreak) {
                     break;
                 }
-
-                auto varNameDecl = exp.list[1];
-                auto varInitDecl = exp.list[2];
-                auto varName = extractVarName(varNameDecl);
-
-                // initializer
-                auto genValue = gen(varInitDecl, env);
-
-                // type
-                // auto varTy = extractVarType(varNameDecl);
-
-                // variable
-                const auto varInit = env->lookup(varName);
-                dprintf(
-                    "%sVariable found: %s\n",
-                    indent.c_str(),
-                    dumpValueToString(varInit.value).c_str());
-                // auto varBinding =
-                //     llvm::dyn_cast<llvm::AllocaInst>(varInit.value);
-
-                // set value
-                assert(varInit.value && "Variable not found");
-                builder->CreateStore(genValue.value, varInit.value);
-                result = {genValue.value, genValue.type};
-                break;
-            } // ----------------------------------------------------
-            // Arithmetic operations:
-            // (+ 1 2)
-            // (- 1 2)
-            // (* 1 2)
-            // (/ 1 2)
-            else if (tag.string == "+") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {builder->CreateAdd(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "-") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {builder->CreateSub(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "*") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {builder->CreateMul(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "/") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {builder->CreateSDiv(lhs.value, rhs.value), lhs.type};
-                break;
-            }
-            // ----------------------------------------------------
-            // Comparison operations:
-            // (== 1 2)
-            // (!= 1 2)
-            // (< 1 2)
-            // (<= 1 2)
-            // (> 1 2)
-            // (>= 1 2)
-            else if (tag.string == "==") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpEQ(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "!=") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpNE(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "<") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpSLT(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == "<=") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpSLE(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == ">") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpSGT(lhs.value, rhs.value), lhs.type};
-                break;
-            } else if (tag.string == ">=") {
-                auto lhs = gen(exp.list[1], env);
-                auto rhs = gen(exp.list[2], env);
-                result = {
-                    builder->CreateICmpSGE(lhs.value, rhs.value), lhs.type};
-                break;
-            }
-
-            // ----------------------------------------------------
-            // If statement:
-            // (if (== x 42) (set x 100) (set x 200))
-            //
-            else if (tag.string == "if") {
-                auto cond = gen(exp.list[1], env);
-                auto thenBB = createBB("then", fn);
-                auto elseBB = createBB("else", fn);
-                auto mergeBB = createBB("ifcont", fn);
-                builder->CreateCondBr(cond.value, thenBB, elseBB);
-
-                // then
-                builder->SetInsertPoint(thenBB);
-                auto thenVal = gen(exp.list[2], env);
-                builder->CreateBr(mergeBB);
-                thenBB = builder->GetInsertBlock();
-
-                // else
-                builder->SetInsertPoint(elseBB);
-                auto elseVal = gen(exp.list[3], env);
-                builder->CreateBr(mergeBB);
-                elseBB = builder->GetInsertBlock();
-
-                // merge
-                builder->SetInsertPoint(mergeBB);
-
-                auto phi = builder->CreatePHI(thenVal.value->getType(), 2);
-                phi->addIncoming(thenVal.value, thenBB);
-                phi->addIncoming(elseVal.value, elseBB);
-                // result = {builder->getInt32(0), nullptr};
-                result = {phi, nullptr};
-                break;
             }
+            var = checkConst(createArithmetic(KW_ADD, var, step), exp);
+        }
+        constEvalLoops_--;
+        return builder->getInt32(0);
+    }
+    case KW_BREAK:
+    case KW_CONTINUE:
+        if (constEvalLoops_ == 0) {
+            throw std::runtime_error("not in a loop: " + exp2str(exp));
+        }
+        throw ConstJump{op == KW_BREAK};
+    }
 
-            // ----------------------------------------------------
-            // While loop
-            // (while (< x 10) (set x (+ x 1)))
-            //
-            else if (tag.string == "while") {
-                dprintf("%sWhile loop\n", indent.c_str());
-                auto condBB = createBB("cond", fn);
-                auto loopBB = createBB("loop", fn);
-                auto afterBB = createBB("afterloop", fn);
-                builder->CreateBr(condBB);
-
-                builder->SetInsertPoint(condBB);
-                auto cond = gen(exp.list[1], env);
-                builder->CreateCondBr(cond.value, loopBB, afterBB);
-
-                builder->SetInsertPoint(loopBB);
-                auto body = gen(exp.list[2], env);
-                builder->CreateBr(condBB);
-
-                builder->SetInsertPoint(afterBB);
-
-                dprintf("%sWhile loop end\n", indent.c_str());
-                result = {builder->getInt32(0), nullptr};
-                break;
-            }
+    // a call of a pure function
+    const auto name = std::string(exp.list[0].string);
+    auto       callee =
+        op >= KEYWORDS_COUNT ? getFunctionBySymbol(op) : nullptr;
+    if (callee == nullptr || !isPureFunction(name)) {
+        throw std::runtime_error("not a pure function: " + exp2str(exp));
+    }
+    std::vector<llvm::Constant*> args;
+    for (size_t i = 1; i < exp.list.size(); i++) {
+        args.push_back(evalNumber(exp.list[i], scope));
+    }
+    return evalConstCall(*defExps_[name], callee, args);
+}
 
-            // ----------------------------------------------------
-            // Function definition
-            // Untyped:
-            //   (def square (x) (* x x))
-            // Typed:
-            //   (def sum ((a number) (b number)) -> number (+ a b))
-            //
-            else if (tag.string == "def") {
-                auto fnName = exp.list[1];
-                if (classType != nullptr) {
-                    fnName.string =
-                        classType->getName().str() + "_" + fnName.string;
-                }
-                auto fnParamsDecl = exp.list[2];
-
-                auto argTypes = getArgTypes(exp);
-                auto argNames = getArgNames(exp);
-                auto retType = getRetType(exp);
-
-                // store insertion point
-                auto currentBlock = builder->GetInsertBlock();
-                auto currentFn = fn;
-
-                fn = createFunction(
-                    fnName.string,
-                    llvm::FunctionType::get(retType, argTypes, false),
-                    env);
-                Exp fnBody = exp.list[3];
-                if (exp.list.size() == 6) {
-                    fnBody = exp.list[5];
-                }
-                auto fnEnv = std::make_shared<Environment>(
-                    std::map<std::string, ValueType>{}, env);
-                auto fnArgs = fn->arg_begin();
-                for (size_t i = 0; i < argNames.size(); i++) {
-                    auto argName = argNames[i];
-                    dprintf(
-                        "%sParsing args: %s, class %s\n",
-                        indent.c_str(),
-                        argName.c_str(),
-                        dumpValueToString(argTypes[i]).c_str());
-                    fnArgs[i].setName(argName);
-                    // store the argument in the function environment
-                    // TODO: arg param can be another class
-                    fnEnv->define(argName, &fnArgs[i], classType);
-                    // initialize the argument
-                    auto arg = allocVar(argName, argTypes[i], fnEnv);
-                    builder->CreateStore(&fnArgs[i], arg);
-                }
-                auto ret = gen(fnBody, fnEnv);
-                builder->CreateRet(ret.value);
-
-                auto typeStr = dumpValueToString(fn->getFunctionType());
-                dprintf(
-                    "%sFunction defined: %s %s\n",
-                    indent.c_str(),
-                    fnName.string.c_str(),
-                    typeStr.c_str());
-                // restore insertion point
-                builder->SetInsertPoint(currentBlock);
-                fn = currentFn;
-
-                result = {fn, nullptr};
-                break;
-            }
+/**
+ * Evaluate a call of a pure function at compile time, the arguments and the
+ * result are converted to its types
+ */
+llvm::Constant* EvaLLVM::evalConstCall(
+    const Exp&                          def,
+    llvm::Function*                     callee,
+    const std::vector<llvm::Constant*>& args) {
+    const auto fnType = callee->getFunctionType();
+    if (args.size() != fnType->getNumParams()) {
+        throw std::runtime_error(
+            "wrong number of arguments: " + callee->getName().str());
+    }
+    if (constEvalDepth_ == constEvalMaxDepth) {
+        throw std::runtime_error("too deep recursion");
+    }
 
-            // ----------------------------------------------------
-            // Class definition
-            // (class Point null
-            //   (begin
-            //     (var x 0)
-            //     (var y 0)
-            //
-            //     ...
-            //   )
-            // )
-            else if (tag.string == "class") {
-                createClass(exp, env);
-                result = {builder->getInt32(0), nullptr};
-                break;
-            }
+    ConstScope fnScope;
+    const auto argNames = getArgNames(def);
+    for (size_t i = 0; i < args.size(); i++) {
+        auto arg =
+            checkConst(castNumber(args[i], fnType->getParamType(i)), def);
+        if (arg->getType() != fnType->getParamType(i)) {
+            throw std::runtime_error("not a number argument: " + argNames[i]);
+        }
+        fnScope.vars[argNames[i]] = arg;
+    }
 
-            // ----------------------------------------------------
-            // Property access getter
-            // (prop Point p x)
-            else if (tag.string == "prop") {
-                result = accessProperty(exp, env);
-                break;
-            }
+    // the loops of the caller can't be left from the callee
+    const auto callerLoops = std::exchange(constEvalLoops_, 0);
+    constEvalDepth_++;
+    auto value =
+        evalConst(def.list.size() == 6 ? def.list[5] : def.list[3], fnScope);
+    constEvalDepth_--;
+    constEvalLoops_ = callerLoops;
+
+    if (value == nullptr ||
+        (value = checkConst(castNumber(value, fnType->getReturnType()), def))
+                ->getType() != fnType->getReturnType()) {
+        throw std::runtime_error(
+            "not a number result: " + callee->getName().str());
+    }
+    return value;
+}
 
-            // ----------------------------------------------------
-            // Method / super call
-            // (method p calc)
-            // (method (self Point) calc)
-            else if (tag.string == "method") {
-                std::string instName;
-                std::string specifiedType;
-                if (exp.list[1].type == ExpType::SYMBOL) {
-                    instName = exp.list[1].string;
-                } else {
-                    instName = exp.list[1].list[0].string;
-                    specifiedType = exp.list[1].list[1].string;
-                }
-                auto methodName = exp.list[2].string;
-                auto inst = gen(instName, env);
-                // original class name
-                auto className = inst.type->getStructName().str();
-                dprintf(
-                    "%sClass name: %s\n", indent.c_str(), className.c_str());
-                if (!specifiedType.empty()) {
-                    className = specifiedType;
-                }
-                dprintf(
-                    "%sSpecified class name: %s\n",
-                    indent.c_str(),
-                    className.c_str());
-
-                auto         funcName = className + "_" + methodName;
-                auto         classInfo = classMap_[className];
-                llvm::Value* fnDest = nullptr;
-                // we're only using vtable if outside of a class, we must use
-                // direct function call inside of a class
-                if (classType == nullptr) {
-                    dprintf(
-                        "%sMethod call outside of class: %s.%s\n",
-                        indent.c_str(),
-                        className.c_str(),
-                        methodName.c_str());
-                    fnDest = loadVtablePtr(inst.value, methodName, className);
-                } else {
-                    fnDest = module->getFunction(funcName);
-                }
+/**
+ * Type of an expression evaluated at compile time, without evaluating it,
+ * e.g. of the branch of an if that isn't taken. The variables it declares
+ * are undef of their type, nullptr if it's a var.
+ */
+llvm::Type* EvaLLVM::inferConstType(const Exp& exp, ConstScope& scope) {
+    auto inferNumber = [&](const Exp& operand) {
+        auto type = inferConstType(operand, scope);
+        if (type == nullptr) {
+            throw std::runtime_error("not a number: " + exp2str(operand));
+        }
+        return type;
+    };
 
-                if (fnDest == nullptr) {
-                    auto e = "Method not found: " + funcName;
-                    throw std::runtime_error(e.c_str());
-                }
-                dprintf(
-                    "%sCalling method: %s\n", indent.c_str(), funcName.c_str());
-
-                result = {
-                    builder->CreateCall(
-                        classInfo.methodTypes[methodName]->getFunctionType(),
-                        fnDest,
-                        genMethodArgs(inst.value, exp, 3, env)),
-                    nullptr};
-                break;
-            }
+    switch (exp.type) {
+    case ExpType::NUMBER:
+        return gen(exp, nullptr).value->getType();
+    case ExpType::STRING:
+        throw std::runtime_error("not a number: " + exp2str(exp));
+    case ExpType::SYMBOL: {
+        if (exp.is(KW_TRUE) || exp.is(KW_FALSE)) {
+            return builder->getInt1Ty();
+        }
+        const auto name = std::string(exp.string);
+        auto       varScope = scope.find(name);
+        if (varScope == nullptr) {
+            throw std::runtime_error("not a local variable: " + name);
+        }
+        return varScope->vars[name]->getType();
+    }
+    case ExpType::LIST:
+        break;
+    }
+    if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL) {
+        throw std::runtime_error("not evaluated: " + exp2str(exp));
+    }
 
-            // ----------------------------------------------------
-            // Function call
-            // (square 2)
-            // try to find the function in the environment
-            dprintf(
-                "%sLooking up function: %s\n",
-                indent.c_str(),
-                tag.string.c_str());
-            // auto fn =
-            //     llvm::dyn_cast<llvm::Function>(env->lookup(tag.string));
-            auto fn = module->getFunction(tag.string);
-            if (fn) {
-                dprintf(
-                    "%sFunction found: %s\n",
-                    indent.c_str(),
-                    tag.string.c_str());
-                result = {
-                    builder->CreateCall(fn, genFunctionArgs(exp, 1, env)),
-                    nullptr};
-                break;
-            }
-            dprintf(
-                "%sFunction not found: %s\n",
-                indent.c_str(),
-                tag.string.c_str());
-
-            // ----------------------------------------------------
-            // Functor call
-            // (transform 10) // where transform is a class with __call__ method
-            auto callable = getCallable(exp, env);
-            if (callable != nullptr) {
-                dprintf(
-                    "%sCalling a functor/callable: %s\n",
-                    indent.c_str(),
-                    tag.string.c_str());
-                const auto classInfo = getClassInfoByVarName(tag.string, env);
-                const auto fnDest = loadVtablePtr(
-                    callable,
-                    "__call__",
-                    classInfo->classType->getStructName().str());
-                result = {
-                    builder->CreateCall(
-                        classInfo->methodTypes["__call__"]->getFunctionType(),
-                        fnDest,
-                        genMethodArgs(callable, exp, 1, env)),
-                    nullptr};
-                break;
+    const auto op = exp.list[0].symbol;
+    switch (op) {
+    case KW_BEGIN: {
+        ConstScope  block{{}, &scope};
+        llvm::Type* type = nullptr;
+        for (size_t i = 1; i < exp.list.size(); i++) {
+            type = inferConstType(exp.list[i], block);
+        }
+        return type;
+    }
+    case KW_VAR: {
+        const auto& decl = exp.list[1];
+        auto        type = inferNumber(exp.list[2]);
+        if (decl.type == ExpType::LIST) {
+            if (!isNumberType(decl.list[1])) {
+                throw std::runtime_error("not a number: " + exp2str(decl));
             }
-            dprintf(
-                "%sCallable not found: %s\n",
-                indent.c_str(),
-                tag.string.c_str());
+            type = extractVarType(decl).type;
         }
-        break;
-    } // case LIST
-    } // switch
+        scope.vars[extractVarName(decl)] = llvm::UndefValue::get(type);
+        return nullptr;
+    }
+    case KW_SET: {
+        auto name = exp.list[1].type == ExpType::SYMBOL
+            ? std::string(exp.list[1].string)
+            : std::string();
+        auto varScope = scope.find(name);
+        if (varScope == nullptr) {
+            throw std::runtime_error("not assignable: " + exp2str(exp));
+        }
+        return varScope->vars[name]->getType();
+    }
+    case KW_ADD:
+    case KW_SUB:
+    case KW_MUL:
+    case KW_DIV:
+        return getCommonType(
+            inferNumber(exp.list[1]), inferNumber(exp.list[2]));
+    case KW_EQ:
+    case KW_NE:
+    case KW_LT:
+    case KW_LE:
+    case KW_GT:
+    case KW_GE:
+        return builder->getInt1Ty();
+    case KW_IF: {
+        const auto thenType = inferNumber(exp.list[2]);
+        const auto elseType = inferNumber(exp.list[3]);
+        return thenType == elseType ? thenType
+                                    : getCommonType(thenType, elseType);
+    }
+    case KW_WHILE:
+    case KW_FOR:
+    case KW_PARALLEL_FOR:
+    case KW_BREAK:
+    case KW_CONTINUE:
+        return builder->getInt32Ty();
+    }
 
-    if (result.value == nullptr) {
-        printf(
-            "%sNot handled %s: %s\n",
-            indent.c_str(),
-            exp_type2str(exp.type).c_str(),
-            exp2str(exp).c_str());
-        throw std::runtime_error("Not implemented");
+    auto callee = op >= KEYWORDS_COUNT ? getFunctionBySymbol(op) : nullptr;
+    if (callee == nullptr) {
+        throw std::runtime_error("not a pure function: " + exp2str(exp));
     }
-    spaces -= 2;
-    dprintf(
-        "%sgen result: value %s, type %s\n",
-        indent.c_str(),
-        dumpValueToString(result.value).c_str(),
-        dumpValueToString(result.type).c_str());
-    return result;
+    return callee->getReturnType();
+}
+
+/**
+ * Trace and count an expression evaluated at compile time
+ */
+void EvaLLVM::reportConstEval(const Exp& exp, llvm::Constant* value) {
+    EVA_TRACE(
+        TRACE_CONST,
+        "%*sEvaluated at compile time: %s = %s\n",
+        traceIndent(),
+        "",
+        exp2str(exp).c_str(),
+        dumpValueToString(value).c_str());
+    if (stats) {
+        stats->constEvals++;
+    }
+}
+
+/**
+ * Get a function created for the symbol, nullptr if there is none
+ */
+llvm::Function* EvaLLVM::getFunctionBySymbol(uint32_t symbol) {
+    if (symbol >= functions_.size() || functions_[symbol] == nullptr) {
+        return nullptr;
+    }
+    return llvm::cast<llvm::Function>(importValue(functions_[symbol]));
+}
+
+/**
+ * Register a function, so it can be called by its symbol
+ */
+void EvaLLVM::registerFunction(const std::string& name, llvm::Function* fn) {
+    auto symbol = parser->symbols.intern(name);
+    if (symbol >= functions_.size()) {
+        functions_.resize(symbol + 1, nullptr);
+    }
+    functions_[symbol] = fn;
 }
 
 /**
  * Gen arguments
  */
-std::vector<llvm::Value*>
-EvaLLVM::genFunctionArgs(const Exp& exp, size_t start, Env env) {
+std::vector<llvm::Value*> EvaLLVM::genFunctionArgs(
+    const Exp& exp, size_t start, Env env, llvm::FunctionType* fnType) {
     std::vector<llvm::Value*> args;
     for (size_t i = start; i < exp.list.size(); i++) {
-        args.push_back(gen(exp.list[i], env).value);
+        args.push_back(castArg(gen(exp.list[i], env).value, fnType, args.size()));
     }
     return args;
 }
@@ -793,21 +2967,123 @@ EvaLLVM::genFunctionArgs(const Exp& exp, size_t start, Env env) {
  * Get method arguments
  */
 std::vector<llvm::Value*> EvaLLVM::genMethodArgs(
-    llvm::Value* inst, const Exp& exp, size_t start, Env env) {
+    llvm::Value*        inst,
+    const Exp&          exp,
+    size_t              start,
+    Env                 env,
+    llvm::FunctionType* fnType) {
     std::vector<llvm::Value*> args;
     args.push_back(inst);
     for (size_t i = start; i < exp.list.size(); i++) {
-        args.push_back(gen(exp.list[i], env).value);
+        args.push_back(castArg(gen(exp.list[i], env).value, fnType, args.size()));
     }
     return args;
 }
 
+/**
+ * Convert a number argument to the parameter type
+ */
+llvm::Value* EvaLLVM::castArg(
+    llvm::Value* arg, llvm::FunctionType* fnType, size_t index) {
+    if (index >= fnType->getNumParams()) {
+        return arg;
+    }
+    return castNumber(arg, fnType->getParamType(index));
+}
+
+/**
+ * Common type of the numbers of a binary operation: a vector wins over the
+ * scalars, the floating point over the integers and the wider type over the
+ * narrower one
+ */
+llvm::Type* EvaLLVM::getCommonType(llvm::Type* lhs, llvm::Type* rhs) {
+    const auto lhsVector = llvm::dyn_cast<llvm::FixedVectorType>(lhs);
+    const auto rhsVector = llvm::dyn_cast<llvm::FixedVectorType>(rhs);
+    if (lhsVector != nullptr && rhsVector != nullptr) {
+        if (lhsVector->getNumElements() != rhsVector->getNumElements()) {
+            throw std::runtime_error("Vectors of different lanes");
+        }
+        return llvm::FixedVectorType::get(
+            getCommonType(
+                lhsVector->getElementType(), rhsVector->getElementType()),
+            lhsVector->getNumElements());
+    } else if (lhsVector != nullptr || rhsVector != nullptr) {
+        return lhsVector != nullptr ? lhs : rhs;
+    }
+    if (lhs->isFloatingPointTy() && rhs->isFloatingPointTy()) {
+        return lhs->getPrimitiveSizeInBits() >= rhs->getPrimitiveSizeInBits()
+            ? lhs
+            : rhs;
+    } else if (lhs->isFloatingPointTy() || rhs->isFloatingPointTy()) {
+        return lhs->isFloatingPointTy() ? lhs : rhs;
+    }
+    if (lhs->isIntegerTy() && rhs->isIntegerTy()) {
+        return lhs->getIntegerBitWidth() >= rhs->getIntegerBitWidth() ? lhs
+                                                                      : rhs;
+    }
+    return lhs;
+}
+
+/**
+ * Convert the operands of a binary operation to their common type
+ */
+void EvaLLVM::promoteOperands(llvm::Value*& lhs, llvm::Value*& rhs) {
+    const auto type = getCommonType(lhs->getType(), rhs->getType());
+    lhs = castNumber(lhs, type);
+    rhs = castNumber(rhs, type);
+}
+
+/**
+ * Convert a number to the type, the other values are returned as is. The
+ * booleans are zero extended, the other integers are sign extended. A number
+ * is splat to all the lanes of a vector, the vectors are converted lane by
+ * lane.
+ */
+llvm::Value* EvaLLVM::castNumber(llvm::Value* value, llvm::Type* type) {
+    const auto from = value->getType();
+    if (from == type) {
+        return value;
+    }
+    if (auto vectorType = llvm::dyn_cast<llvm::FixedVectorType>(type)) {
+        if (from->isIntegerTy() || from->isFloatingPointTy()) {
+            return builder->CreateVectorSplat(
+                vectorType->getNumElements(),
+                castNumber(value, vectorType->getElementType()));
+        }
+        auto fromVector = llvm::dyn_cast<llvm::FixedVectorType>(from);
+        if (fromVector == nullptr ||
+            fromVector->getNumElements() != vectorType->getNumElements()) {
+            return value;
+        }
+    } else if (from->isVectorTy()) {
+        return value;
+    }
+    const auto fromLane = from->getScalarType();
+    const auto toLane = type->getScalarType();
+    if (fromLane->isIntegerTy() && toLane->isIntegerTy()) {
+        return fromLane->isIntegerTy(1)
+            ? builder->CreateZExtOrTrunc(value, type)
+            : builder->CreateSExtOrTrunc(value, type);
+    }
+    if (fromLane->isIntegerTy() && toLane->isFloatingPointTy()) {
+        return fromLane->isIntegerTy(1) ? builder->CreateUIToFP(value, type)
+                                        : builder->CreateSIToFP(value, type);
+    }
+    if (fromLane->isFloatingPointTy() && toLane->isIntegerTy()) {
+        return builder->CreateFPToSI(value, type);
+    }
+    if (fromLane->isFloatingPointTy() && toLane->isFloatingPointTy()) {
+        return builder->CreateFPCast(value, type);
+    }
+    return value;
+}
+
 /**
  * Get callable
  */
 llvm::Value* EvaLLVM::getCallable(const Exp& exp, Env env) {
-    const auto tag = exp.list[0];
-    const auto classInfo = getClassInfoByVarName(tag.string, env);
+    const auto& tag = exp.list[0];
+    const auto  classInfo = getClassInfoByVarName(symbolName(tag), env);
     if (classInfo == nullptr) {
         return nullptr;
     }
@@ -840,14 +3116,25 @@ llvm::Value* EvaLLVM::loadVtablePtr(
     const std::string& className) {
     // get fn from vtable
     auto idx = getMethodIndex(className, methodName);
-    auto vtableGlobalVar = module->getGlobalVariable(className + "_vtable_var");
-    auto vtableType = vtableGlobalVar->getValueType();
+    auto vtableType = getVtable(className)->getValueType();
     // fetch vtable pointer from the instance
-    auto classInfo = classMap_[className];
+    auto& classInfo = classMap_[className];
     auto vtablePtr =
         builder->CreateStructGEP(classInfo.classType, inst, 0, "vtable_gep");
     auto vtable =
         builder->CreateLoad(vtableType->getPointerTo(), vtablePtr, "vtable");
+    // the vtable pointer never changes after the instance is created
+    vtable->setMetadata(
+        llvm::LLVMContext::MD_invariant_group, llvm::MDNode::get(*context, {}));
+    // the vtable belongs to the class or to a subclass, the whole program
+    // devirtualization relies on this
+    auto typeTest = builder->CreateIntrinsic(
+        llvm::Intrinsic::type_test,
+        {},
+        {vtable,
+         llvm::MetadataAsValue::get(
+             *context, llvm::MDString::get(*context, className))});
+    builder->CreateAssumption(typeTest);
     // fetch the method pointer from the vtable
     auto fnPtr = builder->CreateStructGEP(vtableType, vtable, idx, "method");
     return builder->CreateLoad(
@@ -856,6 +3143,95 @@ llvm::Value* EvaLLVM::loadVtablePtr(
         "method");
 }
 
+/**
+ * Get the vtable of a class
+ */
+llvm::GlobalVariable* EvaLLVM::getVtable(const std::string& className) {
+    auto vtable = classMap_[className].vtable;
+    if (vtable == nullptr) {
+        auto e = "Vtable not found for class: " + className;
+        throw std::runtime_error(e.c_str());
+    }
+    return llvm::cast<llvm::GlobalVariable>(importValue(vtable));
+}
+
+/**
+ * Collect the parents and the methods of all the classes of the program
+ */
+void EvaLLVM::scanClassHierarchy(const Exp& exp) {
+    if (exp.type != ExpType::LIST) {
+        return;
+    }
+    // the parent is declared first, so there are no cycles
+    if (isForm(exp, KW_CLASS) && exp.list.size() == 4 &&
+        exp.list[1].type == ExpType::SYMBOL &&
+        exp.list[2].type == ExpType::SYMBOL &&
+        (exp.list[2].string == "null" ||
+         classHierarchy_.count(std::string(exp.list[2].string)))) {
+        auto& decl = classHierarchy_[std::string(exp.list[1].string)];
+        decl.parent = std::string(exp.list[2].string);
+        for (const auto& member : exp.list[3].list) {
+            if (isForm(member, KW_DEF)) {
+                decl.methods.insert(std::string(member.list[1].string));
+            }
+        }
+        return;
+    }
+    for (const auto& e : exp.list) {
+        scanClassHierarchy(e);
+    }
+}
+
+/**
+ * Class hierarchy analysis: if the class and all its subclasses share the
+ * same implementation of the method, it can be called directly. Returns
+ * nullptr if the call has to go through the vtable.
+ *
+ * The hierarchy is only complete for a whole program, the REPL inputs never
+ * see it, so their calls are always virtual.
+ */
+llvm::Function* EvaLLVM::devirtualize(
+    const std::string& className, const std::string& methodName) {
+    if (classHierarchy_.find(className) == classHierarchy_.end()) {
+        return nullptr;
+    }
+    std::string implClass;
+    for (const auto& [name, decl] : classHierarchy_) {
+        // the subclasses of the class, including itself
+        auto base = name;
+        while (base != className && classHierarchy_.count(base)) {
+            base = classHierarchy_[base].parent;
+        }
+        if (base != className) {
+            continue;
+        }
+        // the closest parent defining the method
+        auto impl = name;
+        while (classHierarchy_.count(impl) &&
+               !classHierarchy_[impl].methods.count(methodName)) {
+            impl = classHierarchy_[impl].parent;
+        }
+        if (!classHierarchy_.count(impl)) {
+            return nullptr;
+        }
+        if (!implClass.empty() && implClass != impl) {
+            return nullptr;
+        }
+        implClass = impl;
+    }
+    EVA_TRACE(
+        TRACE_CLASS,
+        "%*sDevirtualized: %s.%s -> %s_%s\n",
+        traceIndent(),
+        "",
+        className.c_str(),
+        methodName.c_str(),
+        implClass.c_str(),
+        methodName.c_str());
+    return getFunctionBySymbol(
+        parser->symbols.intern(implClass + "_" + methodName));
+}
+
 /**
  * Access a property
  * If newValue is provided it's a setter
@@ -863,14 +3239,17 @@ llvm::Value* EvaLLVM::loadVtablePtr(
  */
 ValueType
 EvaLLVM::accessProperty(const Exp& exp, Env env, llvm::Value* newValue) {
-    dprintf("Accessing property: %s\n", exp2str(exp).c_str());
-    auto instExp = exp.list[1];
-    auto varName = exp.list[2].string;
+    EVA_TRACE(TRACE_CLASS, "Accessing property: %s\n", exp2str(exp).c_str());
+    const auto& instExp = exp.list[1];
+    auto        varName = symbolName(exp.list[2]);
     auto genValue = gen(instExp, env);
-    dprintf("Accessing property instExp: %s\n", exp2str(instExp).c_str());
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Accessing property instExp: %s\n",
+        exp2str(instExp).c_str());
     auto type = genValue.type;
-    auto className = type->getStructName().str();
-    auto classInfo = classMap_[className];
+    auto  className = type->getStructName().str();
+    auto& classInfo = classMap_[className];
     if (type == nullptr) {
         auto e = "Class not found: " + varName;
         throw std::runtime_error(e.c_str());
@@ -879,13 +3258,17 @@ EvaLLVM::accessProperty(const Exp& exp, Env env, llvm::Value* newValue) {
     if (newValue != nullptr) { // setter
         auto propPtr = builder->CreateStructGEP(
             type, genValue.value, structIdx, "propPtr" + varName);
-        builder->CreateStore(newValue, propPtr, "prop");
+        builder->CreateStore(
+            castNumber(newValue, classInfo.fieldTypes[varName].type),
+            propPtr,
+            "prop");
         return {builder->getInt32(0), nullptr};
     } else { // getter
         auto propPtr = builder->CreateStructGEP(
             type, genValue.value, structIdx, "propPtr" + varName);
 
-        dprintf(
+        EVA_TRACE(
+            TRACE_CLASS,
             "genValue valuetype: %s, is pointer %d, type %s\n",
             dumpValueToString(genValue.value).c_str(),
             genValue.value->getType()->isPointerTy(),
@@ -902,12 +3285,17 @@ EvaLLVM::accessProperty(const Exp& exp, Env env, llvm::Value* newValue) {
  */
 size_t EvaLLVM::getFieldIndex(llvm::Type* type, const std::string& field) {
     auto structName = type->getStructName().str();
-    dprintf("Getting index for %s.%s\n", structName.c_str(), field.c_str());
-    auto   classInfo = classMap_[structName];
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Getting index for %s.%s\n",
+        structName.c_str(),
+        field.c_str());
+    auto&  classInfo = classMap_[structName];
     size_t idx = 1; // first element is the vtable
     for (const auto& f : classInfo.fieldNames) {
         if (f == field) {
-            dprintf(
+            EVA_TRACE(
+                TRACE_CLASS,
                 "Field found: %s.%s at index %lu\n",
                 structName.c_str(),
                 field.c_str(),
@@ -923,12 +3311,17 @@ size_t EvaLLVM::getFieldIndex(llvm::Type* type, const std::string& field) {
 size_t EvaLLVM::getMethodIndex(
     const std::string& structName, const std::string& field) {
     // auto structName = type->getStructName().str();
-    dprintf("Getting index for %s.%s\n", structName.c_str(), field.c_str());
-    auto   classInfo = classMap_[structName];
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Getting index for %s.%s\n",
+        structName.c_str(),
+        field.c_str());
+    auto&  classInfo = classMap_[structName];
     size_t idx = 0;
     for (const auto& f : classInfo.methodNames) {
         if (f == field) {
-            dprintf(
+            EVA_TRACE(
+                TRACE_CLASS,
                 "Method found: %s.%s at index %lu\n",
                 structName.c_str(),
                 field.c_str(),
@@ -946,7 +3339,7 @@ size_t EvaLLVM::getMethodIndex(
  */
 llvm::Value*
 EvaLLVM::createClassInstance(const Exp& exp, Env env, std::string& varName) {
-    auto className = exp.list[1].string;
+    auto className = symbolName(exp.list[1]);
     auto classType = getClassByName(className);
     if (classType == nullptr) {
         auto e = "Class not found: " + className;
@@ -955,44 +3348,157 @@ EvaLLVM::createClassInstance(const Exp& exp, Env env, std::string& varName) {
     // auto classInfo = classMap_[className];
     auto instName = varName.empty() ? className + "_inst" : varName;
 
-    // Stack example:
-    // auto instance = builder->CreateAlloca(classType, nullptr, varName);
-
-    // malloc example:
+    // the instances which don't escape are moved to the stack later, see
+    // stackAllocateInstances
     auto instance = mallocInsance(classType, "GC_malloc");
     // initialize the vtable
     auto vtablePtr = builder->CreateStructGEP(classType, instance, 0, "vtable");
-    auto vtableGlobal = module->getGlobalVariable(className + "_vtable_var");
-    if (vtableGlobal == nullptr) {
-        auto e = "Vtable not found for class: " + className;
-        throw std::runtime_error(e.c_str());
-    }
-    builder->CreateStore(vtableGlobal, vtablePtr);
+    builder->CreateStore(getVtable(className), vtablePtr)
+        ->setMetadata(
+            llvm::LLVMContext::MD_invariant_group,
+            llvm::MDNode::get(*context, {}));
 
     // call the constructor
-    auto constructor = module->getFunction(className + "_constructor");
+    auto constructor = getFunctionBySymbol(
+        parser->symbols.intern(className + "_constructor"));
     if (constructor == nullptr) {
         auto e = "Constructor not found for class: " + className;
         throw std::runtime_error(e.c_str());
     }
-    auto args = genMethodArgs(instance, exp, 2, env);
-    dprintf("Creating class instance: %s...\n", instName.c_str());
-    env->define(instName, instance, classType);
-    dprintf("Creating class instance: %s\n", instName.c_str());
-    builder->CreateCall(constructor, args);
-    return instance;
+    auto args =
+        genMethodArgs(instance, exp, 2, env, constructor->getFunctionType());
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Creating class instance: %s...\n",
+        instName.c_str());
+    env->define(instName, instance, classType);
+    EVA_TRACE(TRACE_CLASS, "Creating class instance: %s\n", instName.c_str());
+    builder->CreateCall(constructor, args);
+    return instance;
+}
+
+/**
+ * Malloc a class instance, the collector is told which words are pointers.
+ * The instances without pointer fields aren't scanned at all, the vtable
+ * pointer is never traced since the vtables aren't on the GC heap.
+ *
+ * In a region the instance is allocated in its arena instead, a function
+ * which may be called in a region checks for it at run time.
+ */
+llvm::Value*
+EvaLLVM::mallocInsance(llvm::StructType* classType, const std::string& name) {
+    // the allocators take a size_t
+    const auto size = builder->getInt64(getTypeSize(classType));
+    if (regionDepth_ > 0 || maybeInRegion_) {
+        auto instance = builder->CreateCall(
+            module->getFunction(
+                regionDepth_ > 0 ? "eva_region_alloc" : "eva_alloc"),
+            size,
+            name);
+        return builder->CreateBitCast(instance, classType->getPointerTo());
+    }
+
+    const auto bitmap = getPointerBitmap(classType);
+    if (std::all_of(bitmap.begin(), bitmap.end(), [](uint64_t word) {
+            return word == 0;
+        })) {
+        auto instance = builder->CreateCall(
+            module->getFunction("GC_malloc_atomic"), size, name);
+        // unlike GC_malloc, the atomic memory isn't cleared
+        builder->CreateMemSet(
+            instance, builder->getInt8(0), size, llvm::MaybeAlign(8));
+        return builder->CreateBitCast(instance, classType->getPointerTo());
+    }
+
+    auto descriptor =
+        builder->CreateCall(getGcDescriptor(classType, bitmap), {}, "gc_descr");
+    auto instance = builder->CreateCall(
+        module->getFunction("GC_malloc_explicitly_typed"),
+        {size, descriptor},
+        name);
+    return builder->CreateBitCast(instance, classType->getPointerTo());
+}
+
+/**
+ * Bitmap of the pointer fields of a class, a bit per word of the instance
+ */
+std::vector<uint64_t> EvaLLVM::getPointerBitmap(llvm::StructType* classType) {
+    const auto layout = module->getDataLayout().getStructLayout(classType);
+    const auto wordSize = module->getDataLayout().getPointerSize();
+    const auto words = (layout->getSizeInBytes() + wordSize - 1) / wordSize;
+    std::vector<uint64_t> bitmap((words + 63) / 64, 0);
+    // the first element is the vtable
+    for (unsigned i = 1; i < classType->getNumElements(); i++) {
+        if (classType->getElementType(i)->isPointerTy()) {
+            const auto word = layout->getElementOffset(i) / wordSize;
+            bitmap[word / 64] |= uint64_t(1) << (word % 64);
+        }
+    }
+    return bitmap;
 }
 
 /**
- * Malloc a class instance
+ * Get the function returning the GC type descriptor of a class. The
+ * descriptor is made by libgc on the first call and kept in a global, every
+ * module has its own copy.
  */
-llvm::Value*
-EvaLLVM::mallocInsance(llvm::StructType* classType, const std::string& name) {
-    auto instance = builder->CreateCall(
-        module->getFunction("GC_malloc"),
-        builder->getInt32(getTypeSize(classType)),
-        name);
-    return builder->CreateBitCast(instance, classType->getPointerTo());
+llvm::Function* EvaLLVM::getGcDescriptor(
+    llvm::StructType* classType, const std::vector<uint64_t>& bitmap) {
+    const auto className = classType->getName().str();
+    const auto fnName = className + "_gc_descr";
+    if (auto fn = module->getFunction(fnName)) {
+        return fn;
+    }
+    const auto& dataLayout = module->getDataLayout();
+    const auto  words =
+        dataLayout.getStructLayout(classType)->getSizeInBytes() /
+        dataLayout.getPointerSize();
+
+    auto wordTy = builder->getInt64Ty();
+    auto bitmapTy = llvm::ArrayType::get(wordTy, bitmap.size());
+    auto bitmapVar = new llvm::GlobalVariable(
+        *module,
+        bitmapTy,
+        /* isConstant */ true,
+        llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantDataArray::get(*context, bitmap),
+        className + "_gc_bitmap");
+    auto descriptorVar = new llvm::GlobalVariable(
+        *module,
+        wordTy,
+        /* isConstant */ false,
+        llvm::GlobalValue::InternalLinkage,
+        builder->getInt64(0),
+        className + "_gc_descr_var");
+
+    auto fn = llvm::Function::Create(
+        llvm::FunctionType::get(wordTy, false),
+        llvm::GlobalValue::InternalLinkage,
+        fnName,
+        *module);
+    auto entryBB = llvm::BasicBlock::Create(*context, "entry", fn);
+    auto initBB = llvm::BasicBlock::Create(*context, "init", fn);
+    auto doneBB = llvm::BasicBlock::Create(*context, "done", fn);
+
+    // the threads racing on the first call store the same descriptor
+    llvm::IRBuilder<> fnBuilder(entryBB);
+    auto              descriptor = fnBuilder.CreateLoad(wordTy, descriptorVar);
+    descriptor->setAtomic(llvm::AtomicOrdering::Monotonic);
+    descriptor->setAlignment(llvm::Align(8));
+    fnBuilder.CreateCondBr(
+        fnBuilder.CreateIsNull(descriptor), initBB, doneBB);
+
+    fnBuilder.SetInsertPoint(initBB);
+    auto newDescriptor = fnBuilder.CreateCall(
+        module->getFunction("GC_make_descriptor"),
+        {bitmapVar, fnBuilder.getInt64(words)});
+    fnBuilder.CreateAlignedStore(newDescriptor, descriptorVar, llvm::Align(8))
+        ->setAtomic(llvm::AtomicOrdering::Monotonic);
+    fnBuilder.CreateRet(newDescriptor);
+
+    fnBuilder.SetInsertPoint(doneBB);
+    fnBuilder.CreateRet(descriptor);
+    return fn;
 }
 
 /**
@@ -1006,13 +3512,26 @@ size_t EvaLLVM::getTypeSize(llvm::Type* type) {
  * Create a Class
  */
 void EvaLLVM::createClass(const Exp& exp, Env env) {
+    declareClass(exp, env);
+
+    // Compile the body
+    classType = classMap_[symbolName(exp.list[1])].classType;
+    gen(exp.list[3], env);
+
+    // Reset the class type
+    classType = nullptr;
+}
+
+/**
+ * Declare a class: the struct type, the method prototypes and the vtable
+ */
+void EvaLLVM::declareClass(const Exp& exp, Env env) {
     // check size of the list
     if (exp.list.size() != 4) {
         throw std::runtime_error("Invalid class definition");
     }
-    auto className = exp.list[1].string;
-    auto classParent = exp.list[2].string;
-    auto classBody = exp.list[3];
+    auto className = symbolName(exp.list[1]);
+    auto classParent = symbolName(exp.list[2]);
     // printf("Creating class %s\n", className.c_str());
     // printf("Parent class %s\n", classParent.c_str());
 
@@ -1026,32 +3545,55 @@ void EvaLLVM::createClass(const Exp& exp, Env env) {
     // Scan the class body, since the constructor can call methods
     buildClassInfo(classType, exp, env);
 
-    // Compile the body
-    gen(classBody, env);
-
     // Reset the class type
     classType = nullptr;
 }
 
+/**
+ * Define the methods of a declared class, the fields are already known
+ */
+void EvaLLVM::defineClassMethods(const Exp& exp, Env env) {
+    classType = classMap_[symbolName(exp.list[1])].classType;
+    const auto& classBody = exp.list[3];
+    for (size_t i = 1; i < classBody.list.size(); i++) {
+        if (classBody.list[i].list[0].is(KW_DEF)) {
+            genDef(classBody.list[i], env);
+        }
+    }
+    classType = nullptr;
+}
+
+/**
+ * Declare a function prototype ahead of its definition
+ */
+void EvaLLVM::declareFunction(const Exp& exp, Env env) {
+    createFunctionProto(
+        symbolName(exp.list[1]),
+        llvm::FunctionType::get(getRetType(exp), getArgTypes(exp), false),
+        env);
+    registerDef(exp);
+}
+
 /**
  * Build class information
  */
 void EvaLLVM::buildClassInfo(
     llvm::StructType* classType, const Exp& exp, Env env) {
-    auto className = exp.list[1].string;
+    auto className = symbolName(exp.list[1]);
     // check size of the list
     if (exp.list.size() != 4) {
         throw std::runtime_error("Invalid class definition");
     }
-    auto classBody = exp.list[3];
+    const auto& classBody = exp.list[3];
 
     // first element must be a string "begin"
-    if (classBody.list[0].string != "begin") {
+    if (!classBody.list[0].is(KW_BEGIN)) {
         throw std::runtime_error("Invalid class body, missing 'begin' element");
     }
-    dprintf(
+    EVA_TRACE(
+        TRACE_CLASS,
         "Building class info, first element: %s\n",
-        classBody.list[0].string.c_str());
+        exp2str(classBody.list[0]).c_str());
 
     // Shallow scanning of the class body, we need to know all the fields,
     // methods and their types
@@ -1063,11 +3605,14 @@ void EvaLLVM::buildClassInfo(
             throw std::runtime_error(
                 "Invalid class body, expected list element");
         }
-        dprintf("Building class info, element: %s\n", exp2str(beginLE).c_str());
-        const auto firstLE = beginLE.list[0].string;
+        EVA_TRACE(
+            TRACE_CLASS,
+            "Building class info, element: %s\n",
+            exp2str(beginLE).c_str());
+        const auto& firstLE = beginLE.list[0];
 
         // if var, update a struct
-        if (firstLE == "var") {
+        if (firstLE.is(KW_VAR)) {
             auto& expName = beginLE.list[1];
             auto& expInit = beginLE.list[2];
 
@@ -1075,19 +3620,17 @@ void EvaLLVM::buildClassInfo(
             auto varType = extractVarType(expName);
             addFieldToClass(
                 className, varNameDecl, varType.type, varType.ptrType);
-            dprintf(
+            EVA_TRACE(
+                TRACE_CLASS,
                 "Building class info, var: %s.%s, type %s, ptr type %s...\n",
                 className.c_str(),
                 varNameDecl.c_str(),
                 dumpValueToString(varType.type).c_str(),
                 dumpValueToString(varType.ptrType).c_str());
-            if (expName.string == "SetFunctor.cell")
-                exit(-1);
         }
         // if def, create a function
-        else if (firstLE == "def") {
-            auto fnName = beginLE.list[1];
-            auto fnParamsDecl = beginLE.list[2];
+        else if (firstLE.is(KW_DEF)) {
+            auto fnName = symbolName(beginLE.list[1]);
             auto argTypes = getArgTypes(beginLE);
             auto argNames = getArgNames(beginLE);
             auto retType = getRetType(beginLE);
@@ -1096,14 +3639,17 @@ void EvaLLVM::buildClassInfo(
                 throw std::runtime_error("First argument must be 'self'");
             }
             auto fn = createFunctionProto(
-                className + "_" + fnName.string,
+                className + "_" + fnName,
                 llvm::FunctionType::get(retType, argTypes, false),
                 env);
-            addMethodToClass(className, fnName.string, fn);
-            dprintf("Building class info, method: %s\n", fnName.string.c_str());
+            addMethodToClass(className, fnName, fn);
+            EVA_TRACE(
+                TRACE_CLASS,
+                "Building class info, method: %s\n",
+                fnName.c_str());
 
         } else {
-            // printf("Unknown class body element: %s\n", firstLE.c_str());
+            // printf("Unknown class body element: %s\n", exp2str(firstLE));
             throw std::runtime_error("Invalid class body element");
         }
     }
@@ -1127,18 +3673,30 @@ void EvaLLVM::buildClassInfo(
             auto e = "Method not found: " + className + "_" + methodName;
             throw std::runtime_error(e.c_str());
         }
-        vtableInit.push_back(fn);
+        // inherited methods can come from the previous REPL modules
+        vtableInit.push_back(llvm::cast<llvm::Constant>(importValue(fn)));
     }
 
     vtableGlobal->setInitializer(
         llvm::ConstantStruct::get(vtableType, vtableInit));
     vtableGlobal->setAlignment(llvm::MaybeAlign(8));
+    // the methods of the parents are at the same indices, so the vtable is
+    // also compatible with all of them
+    for (auto name = className; name != "null"; name = classMap_[name].parent) {
+        vtableGlobal->addTypeMetadata(0, llvm::MDString::get(*context, name));
+    }
+    vtableGlobal->setVCallVisibilityMetadata(
+        llvm::GlobalObject::VCallVisibilityLinkageUnit);
+    classMap_[className].vtable = vtableGlobal;
 
     // init struct fields
     const auto fields = serializeFieldTypes(vtableType, className);
     classType->setBody(fields);
 
-    dprintf("Class info built: %s\n", dumpValueToString(classType).c_str());
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Class info built: %s\n",
+        dumpValueToString(classType).c_str());
 }
 
 /**
@@ -1163,6 +3721,263 @@ llvm::StructType* EvaLLVM::getClassByName(const std::string& name) {
     return llvm::StructType::getTypeByName(*context, name);
 }
 
+/**
+ * Get a builtin type, nullptr for the classes
+ */
+llvm::Type* EvaLLVM::getBuiltinType(const Exp& type) {
+    if (isArrayType(type)) {
+        return builder->getPtrTy();
+    } else if (type.type == ExpType::LIST) {
+        return getVectorType(type);
+    } else if (type.type != ExpType::SYMBOL) {
+        return nullptr;
+    }
+    if (type.string == "number" || type.string == "i32") {
+        return builder->getInt32Ty();
+    } else if (type.string == "i64") {
+        return builder->getInt64Ty();
+    } else if (type.string == "f32") {
+        return builder->getFloatTy();
+    } else if (type.string == "f64") {
+        return builder->getDoubleTy();
+    } else if (type.string == "string") {
+        return builder->getPtrTy();
+    }
+    return nullptr;
+}
+
+/**
+ * Get a vector type: (vec4 f32), the lanes are numbers
+ */
+llvm::FixedVectorType* EvaLLVM::getVectorType(const Exp& type) {
+    const auto lanes = getVectorLanes(type);
+    if (lanes == 0 || type.list.size() < 2) {
+        throw std::runtime_error("Invalid vector type: " + exp2str(type));
+    }
+    const auto elementType = getBuiltinType(type.list[1]);
+    if (elementType == nullptr ||
+        !(elementType->isIntegerTy() || elementType->isFloatingPointTy())) {
+        throw std::runtime_error("Invalid vector lane type: " + exp2str(type));
+    }
+    return llvm::FixedVectorType::get(elementType, lanes);
+}
+
+/**
+ * Get an array type: (array f64), the element is declared as of a variable.
+ * The header is {size, capacity, data}, its type is named after the element
+ * type, e.g. array.double, so the arrays of the same elements share it.
+ */
+llvm::StructType* EvaLLVM::getArrayType(const Exp& type) {
+    if (type.type != ExpType::LIST || type.list.size() < 2 ||
+        !type.list[0].is(KW_ARRAY)) {
+        throw std::runtime_error("Invalid array type: " + exp2str(type));
+    }
+    const auto element = extractVarType(type);
+    const auto name = "array." +
+        (element.ptrType != nullptr ? element.ptrType->getStructName().str()
+                                    : dumpValueToString(element.type));
+    auto arrayType = llvm::StructType::getTypeByName(*context, name);
+    if (arrayType == nullptr) {
+        arrayType = llvm::StructType::create(
+            *context,
+            {builder->getInt64Ty(), builder->getInt64Ty(), builder->getPtrTy()},
+            name);
+    }
+    arrayElements_[arrayType] = element;
+    return arrayType;
+}
+
+/**
+ * Get the array type of a value
+ */
+llvm::StructType*
+EvaLLVM::getArrayTypeOf(const ValueType& array, const Exp& exp) {
+    if (arrayElements_.count(array.type) == 0) {
+        throw std::runtime_error("Not an array: " + exp2str(exp));
+    }
+    return llvm::cast<llvm::StructType>(array.type);
+}
+
+/**
+ * Pointer to the element of (at a i), the index is checked against the size.
+ * The check is an unsigned comparison, so it also catches the negative
+ * indices, and the optimizer removes it when a loop condition on the size
+ * already implies it.
+ */
+llvm::Value*
+EvaLLVM::genElementPtr(const Exp& exp, Env env, TypeType& element) {
+    if (exp.list.size() != 3) {
+        throw std::runtime_error("Invalid array element: " + exp2str(exp));
+    }
+    auto       array = gen(exp.list[1], env);
+    const auto arrayType = getArrayTypeOf(array, exp.list[1]);
+    element = arrayElements_[arrayType];
+    auto index =
+        castNumber(gen(exp.list[2], env).value, builder->getInt64Ty());
+    if (!index->getType()->isIntegerTy(64)) {
+        throw std::runtime_error("Invalid array index: " + exp2str(exp));
+    }
+
+    auto size = loadArrayField(arrayType, array.value, 0);
+    auto failBB = createBB("outofbounds", fn);
+    auto okBB = createBB("inbounds", fn);
+    builder->CreateCondBr(
+        builder->CreateICmpULT(index, size),
+        okBB,
+        failBB,
+        llvm::MDBuilder(*context).createBranchWeights(1000, 1));
+
+    builder->SetInsertPoint(failBB);
+    builder->CreateCall(
+        module->getFunction("eva_array_bounds_fail"), {index, size});
+    builder->CreateUnreachable();
+
+    builder->SetInsertPoint(okBB);
+    auto data = loadArrayField(arrayType, array.value, 2);
+    return builder->CreateInBoundsGEP(element.type, data, index, "element");
+}
+
+/**
+ * Load a field of the array header: 0 size, 1 capacity, 2 data
+ */
+llvm::Value* EvaLLVM::loadArrayField(
+    llvm::StructType* arrayType, llvm::Value* array, unsigned index) {
+    auto load = builder->CreateLoad(
+        arrayType->getElementType(index),
+        builder->CreateStructGEP(arrayType, array, index),
+        arrayFieldNames[index]);
+    load->setMetadata(
+        llvm::LLVMContext::MD_tbaa,
+        getArrayTBAA(std::string("array ") + arrayFieldNames[index]));
+    return load;
+}
+
+/**
+ * Store a field of the array header
+ */
+void EvaLLVM::storeArrayField(
+    llvm::StructType* arrayType,
+    llvm::Value*      array,
+    unsigned          index,
+    llvm::Value*      value) {
+    builder
+        ->CreateStore(value, builder->CreateStructGEP(arrayType, array, index))
+        ->setMetadata(
+            llvm::LLVMContext::MD_tbaa,
+            getArrayTBAA(std::string("array ") + arrayFieldNames[index]));
+}
+
+/**
+ * TBAA tag of the array memory: the header fields and the elements of each
+ * type never overlap, so the stores of the elements don't clobber the size
+ * and the data pointer, and their loads are hoisted out of the loops
+ */
+llvm::MDNode* EvaLLVM::getArrayTBAA(const std::string& name) {
+    llvm::MDBuilder mdBuilder(*context);
+    auto            root = mdBuilder.createTBAARoot("Eva arrays");
+    auto type = mdBuilder.createTBAAScalarTypeNode(name, root);
+    return mdBuilder.createTBAAStructTagNode(type, type, 0);
+}
+
+/**
+ * Tag a load or a store of an array element: its TBAA type and the access
+ * groups of the parallel loops it's in
+ */
+void EvaLLVM::tagElementAccess(
+    llvm::Instruction* access, llvm::Type* elementType) {
+    access->setMetadata(
+        llvm::LLVMContext::MD_tbaa,
+        getArrayTBAA("array element " + dumpValueToString(elementType)));
+    if (accessGroups_.size() == 1) {
+        access->setMetadata(
+            llvm::LLVMContext::MD_access_group, accessGroups_.front());
+    } else if (!accessGroups_.empty()) {
+        std::vector<llvm::Metadata*> groups(
+            accessGroups_.begin(), accessGroups_.end());
+        access->setMetadata(
+            llvm::LLVMContext::MD_access_group,
+            llvm::MDNode::get(*context, groups));
+    }
+}
+
+/**
+ * Loop metadata of a for loop: its hints, the access group of a parallel
+ * loop, and the progress of a constant step. The unroll hints of a vectorized
+ * loop apply to the vector loop, the scalar one isn't unrolled first. The
+ * first operand is the loop itself, it makes the node distinct.
+ */
+llvm::MDNode* EvaLLVM::getLoopMetadata(
+    const Exp& exp, llvm::ConstantInt* step, llvm::MDNode* accessGroup) {
+    auto createHint = [&](const char* name, llvm::Metadata* value = nullptr) {
+        std::vector<llvm::Metadata*> hint{llvm::MDString::get(*context, name)};
+        if (value != nullptr) {
+            hint.push_back(value);
+        }
+        return llvm::MDNode::get(*context, hint);
+    };
+    auto constant = [&](llvm::Constant* value) {
+        return llvm::ConstantAsMetadata::get(value);
+    };
+
+    std::vector<llvm::Metadata*> ops{nullptr};
+    std::vector<llvm::Metadata*> unrollOps;
+    if (step != nullptr) {
+        ops.push_back(createHint("llvm.loop.mustprogress"));
+    }
+    auto vectorize = accessGroup != nullptr;
+    for (size_t i = 2; i < exp.list.size() - 1; i++) {
+        const auto& hint = exp.list[i];
+        if (hint.type != ExpType::LIST || hint.list.size() != 2 ||
+            hint.list[0].type != ExpType::SYMBOL ||
+            hint.list[1].type != ExpType::NUMBER ||
+            hint.list[1].numberType != NumberType::I32 ||
+            hint.list[1].number < 1) {
+            throw std::runtime_error("Invalid loop hint: " + exp2str(hint));
+        }
+        const auto count = hint.list[1].number;
+        // (unroll 1) and (vectorize 1) disable them
+        if (hint.list[0].string == "unroll") {
+            unrollOps.push_back(
+                count == 1 ? createHint("llvm.loop.unroll.disable")
+                           : createHint(
+                                 "llvm.loop.unroll.count",
+                                 constant(builder->getInt32(count))));
+        } else if (hint.list[0].string == "vectorize") {
+            vectorize = count > 1;
+            ops.push_back(
+                vectorize ? createHint(
+                                "llvm.loop.vectorize.width",
+                                constant(builder->getInt32(count)))
+                          : createHint(
+                                "llvm.loop.vectorize.enable",
+                                constant(builder->getFalse())));
+        } else {
+            throw std::runtime_error("Unknown loop hint: " + exp2str(hint));
+        }
+    }
+    if (accessGroup != nullptr) {
+        ops.push_back(createHint("llvm.loop.parallel_accesses", accessGroup));
+    }
+    if (vectorize) {
+        ops.push_back(createHint(
+            "llvm.loop.vectorize.enable", constant(builder->getTrue())));
+        if (!unrollOps.empty()) {
+            unrollOps.insert(
+                unrollOps.begin(),
+                {llvm::MDString::get(
+                     *context, "llvm.loop.vectorize.followup_all"),
+                 createHint("llvm.loop.isvectorized")});
+            ops.push_back(llvm::MDNode::get(*context, unrollOps));
+        }
+    } else {
+        ops.insert(ops.end(), unrollOps.begin(), unrollOps.end());
+    }
+
+    auto loop = llvm::MDNode::getDistinct(*context, ops);
+    loop->replaceOperandWith(0, loop);
+    return loop;
+}
+
 /**
  * Get the return type
  */
@@ -1170,22 +3985,22 @@ llvm::Type* EvaLLVM::getRetType(const Exp& exp) {
     if (exp.list.size() == 4) {
         return builder->getInt32Ty();
     } else if (exp.list.size() == 6) {
-        auto possibleArrowStr = exp.list[3];
-        if (possibleArrowStr.type == ExpType::SYMBOL &&
-            possibleArrowStr.string == "->") {
-            auto retType = exp.list[4];
-            if (retType.string == "number") {
-                return builder->getInt32Ty();
-            } else if (retType.string == "string") {
-                return builder->getPtrTy();
-            } else if (classMap_.find(retType.string) != classMap_.end()) {
-                return classMap_[retType.string].classType->getPointerTo();
+        const auto& possibleArrowStr = exp.list[3];
+        if (possibleArrowStr.is(KW_ARROW)) {
+            const auto& retType = exp.list[4];
+            if (auto type = getBuiltinType(retType)) {
+                return type;
+            } else if (
+                retType.type == ExpType::SYMBOL &&
+                classMap_.count(std::string(retType.string)) != 0) {
+                return classMap_[std::string(retType.string)]
+                    .classType->getPointerTo();
             } else {
                 throw std::runtime_error("Invalid return type");
             }
         }
     }
-    dprintf("Unknown return type, assuming int\n");
+    EVA_TRACE(TRACE_FUNC, "Unknown return type, assuming int\n");
     return builder->getInt32Ty();
 }
 
@@ -1196,19 +4011,22 @@ llvm::Type* EvaLLVM::getRetType(const Exp& exp) {
 std::vector<llvm::Type*> EvaLLVM::getArgTypes(const Exp& exp) {
     std::vector<llvm::Type*> argTypes;
     if (exp.list.size() > 2) {
-        auto fnParamsDecl = exp.list[2];
+        const auto& fnParamsDecl = exp.list[2];
+        if (fnParamsDecl.type != ExpType::LIST) {
+            throw std::runtime_error("Invalid argument declaration");
+        }
         for (size_t i = 0; i < fnParamsDecl.list.size(); i++) {
-            auto argDecl = fnParamsDecl.list[i];
+            const auto& argDecl = fnParamsDecl.list[i];
             if (argDecl.type == ExpType::LIST) {
                 if (argDecl.list.size() == 2) {
-                    auto argType = argDecl.list[1].string;
-                    if (argType == "number") {
-                        argTypes.push_back(builder->getInt32Ty());
-                    } else if (argType == "string") {
-                        argTypes.push_back(builder->getPtrTy());
+                    const auto& argType = argDecl.list[1];
+                    if (auto type = getBuiltinType(argType)) {
+                        argTypes.push_back(type);
                     } else {
                         // try class type
-                        auto classType = getClassByName(argType);
+                        auto classType = argType.type == ExpType::SYMBOL
+                            ? getClassByName(std::string(argType.string))
+                            : nullptr;
                         if (classType != nullptr) {
                             argTypes.push_back(classType->getPointerTo());
                         } else {
@@ -1220,7 +4038,7 @@ std::vector<llvm::Type*> EvaLLVM::getArgTypes(const Exp& exp) {
                 }
             } else if (argDecl.type == ExpType::SYMBOL) {
                 // check if the name is 'self'
-                if (argDecl.string == "self") {
+                if (argDecl.is(KW_SELF)) {
                     // printf("Found 'self' argument\n");
                     // classType->dump();
                     argTypes.push_back(classType->getPointerTo());
@@ -1242,14 +4060,16 @@ std::vector<llvm::Type*> EvaLLVM::getArgTypes(const Exp& exp) {
 std::vector<std::string> EvaLLVM::getArgNames(const Exp& exp) {
     std::vector<std::string> argNames;
     if (exp.list.size() > 2) {
-        auto fnParamsDecl = exp.list[2];
+        const auto& fnParamsDecl = exp.list[2];
+        if (fnParamsDecl.type != ExpType::LIST) {
+            throw std::runtime_error("Invalid argument declaration");
+        }
         for (size_t i = 0; i < fnParamsDecl.list.size(); i++) {
-            auto argDecl = fnParamsDecl.list[i];
+            const auto& argDecl = fnParamsDecl.list[i];
             if (argDecl.type == ExpType::LIST) {
-                auto argName = argDecl.list[0].string;
-                argNames.push_back(argName);
+                argNames.emplace_back(symbolName(argDecl.list[0]));
             } else if (argDecl.type == ExpType::SYMBOL) {
-                argNames.push_back(argDecl.string);
+                argNames.emplace_back(argDecl.string);
             } else {
                 throw std::runtime_error("Invalid argument declaration");
             }
@@ -1263,9 +4083,9 @@ std::vector<std::string> EvaLLVM::getArgNames(const Exp& exp) {
  */
 std::string EvaLLVM::extractVarName(const Exp& varDecl) {
     if (varDecl.type == ExpType::SYMBOL) {
-        return varDecl.string;
-    } else if (varDecl.type == ExpType::LIST) {
-        return varDecl.list[0].string;
+        return std::string(varDecl.string);
+    } else if (varDecl.type == ExpType::LIST && !varDecl.list.empty()) {
+        return symbolName(varDecl.list[0]);
     } else {
         throw std::runtime_error("Invalid variable declaration");
     }
@@ -1278,14 +4098,16 @@ std::string EvaLLVM::extractVarName(const Exp& varDecl) {
 TypeType EvaLLVM::extractVarType(const Exp& varDecl) {
     if (varDecl.type == ExpType::SYMBOL) {
         return {builder->getInt32Ty(), nullptr};
-    } else if (varDecl.type == ExpType::LIST) {
-        if (varDecl.list[1].string == "number") {
-            return {builder->getInt32Ty(), nullptr};
-        } else if (varDecl.list[1].string == "string") {
-            return {builder->getPtrTy(), nullptr};
+    } else if (varDecl.type == ExpType::LIST && varDecl.list.size() >= 2) {
+        if (isArrayType(varDecl.list[1])) {
+            return {builder->getPtrTy(), getArrayType(varDecl.list[1])};
+        } else if (auto type = getBuiltinType(varDecl.list[1])) {
+            return {type, nullptr};
         } else {
             // try class type
-            auto classType = classMap_[varDecl.list[1].string].classType;
+            auto classType = varDecl.list[1].type == ExpType::SYMBOL
+                ? classMap_[std::string(varDecl.list[1].string)].classType
+                : nullptr;
             if (classType != nullptr) {
                 return {builder->getPtrTy(), classType};
             }
@@ -1295,9 +4117,10 @@ TypeType EvaLLVM::extractVarType(const Exp& varDecl) {
     } else {
         throw std::runtime_error("Invalid variable declaration");
     }
-    dprintf(
+    EVA_TRACE(
+        TRACE_VAR,
         "Unknown variable type for '%s', assuming int\n",
-        varDecl.string.c_str());
+        exp2str(varDecl).c_str());
     return {builder->getInt32Ty(), nullptr};
 }
 
@@ -1306,10 +4129,13 @@ TypeType EvaLLVM::extractVarType(const Exp& varDecl) {
  */
 llvm::AllocaInst*
 EvaLLVM::allocVar(const std::string& varName, llvm::Type* varTy, Env env) {
-    varsBuilder->SetInsertPoint(&fn->getEntryBlock());
+    // at the top of the entry block, it may already be terminated
+    auto& entry = fn->getEntryBlock();
+    varsBuilder->SetInsertPoint(&entry, entry.getFirstInsertionPt());
     auto var = varsBuilder->CreateAlloca(varTy, nullptr, varName);
     // if varTy is a pointer we must find the original type
-    dprintf(
+    EVA_TRACE(
+        TRACE_VAR,
         "Allocating var: %s, type %s\n",
         varName.c_str(),
         dumpValueToString(varTy).c_str());
@@ -1339,30 +4165,559 @@ void EvaLLVM::setupExternalFunctions() {
         /* result */ builder->getInt32Ty(),
         /* format arg */ builder->getPtrTy(),
         /* vararg */ true);
-    module->getOrInsertFunction("printf", printfType);
+    registerFunction(
+        "printf",
+        llvm::cast<llvm::Function>(
+            module->getOrInsertFunction("printf", printfType).getCallee()));
 
     // add malloc declaration
     auto mallocType = llvm::FunctionType::get(
         /* result */ builder->getPtrTy(),
-        /* size_t arg */ builder->getInt32Ty(),
+        /* size_t arg */ builder->getInt64Ty(),
         /* vararg */ false);
     module->getOrInsertFunction("GC_malloc", mallocType);
+    // the memory of GC_malloc_atomic isn't scanned for pointers
+    module->getOrInsertFunction("GC_malloc_atomic", mallocType);
+
+    // typed allocation, the descriptor tells the pointer words apart
+    auto descriptorType = builder->getInt64Ty();
+    module->getOrInsertFunction(
+        "GC_make_descriptor",
+        llvm::FunctionType::get(
+            /* result */ descriptorType,
+            /* bitmap, length in words */
+            {builder->getPtrTy(), builder->getInt64Ty()},
+            /* vararg */ false));
+    module->getOrInsertFunction(
+        "GC_malloc_explicitly_typed",
+        llvm::FunctionType::get(
+            /* result */ builder->getPtrTy(),
+            /* size_t arg, descriptor */
+            {builder->getInt64Ty(), descriptorType},
+            /* vararg */ false));
+
+    // regions, see runtime/EvaRuntime.h
+    module->getOrInsertFunction(
+        "eva_region_enter",
+        llvm::FunctionType::get(builder->getPtrTy(), /* vararg */ false));
+    module->getOrInsertFunction(
+        "eva_region_exit",
+        llvm::FunctionType::get(
+            builder->getVoidTy(), builder->getPtrTy(), /* vararg */ false));
+    module->getOrInsertFunction("eva_region_alloc", mallocType);
+    module->getOrInsertFunction("eva_alloc", mallocType);
+
+    // dynamic arrays
+    module->getOrInsertFunction(
+        "eva_array_new",
+        llvm::FunctionType::get(
+            /* result */ builder->getPtrTy(),
+            /* size, element size, pointers */
+            {builder->getInt64Ty(),
+             builder->getInt64Ty(),
+             builder->getInt32Ty()},
+            /* vararg */ false));
+    module->getOrInsertFunction(
+        "eva_array_grow",
+        llvm::FunctionType::get(
+            /* result */ builder->getVoidTy(),
+            /* array, element size, pointers */
+            {builder->getPtrTy(),
+             builder->getInt64Ty(),
+             builder->getInt32Ty()},
+            /* vararg */ false));
+    // the failure path is cold and never returns, so the checks don't keep
+    // the loops from being optimized
+    auto boundsFail = llvm::cast<llvm::Function>(
+        module
+            ->getOrInsertFunction(
+                "eva_array_bounds_fail",
+                llvm::FunctionType::get(
+                    /* result */ builder->getVoidTy(),
+                    /* index, size */
+                    {builder->getInt64Ty(), builder->getInt64Ty()},
+                    /* vararg */ false))
+            .getCallee());
+    boundsFail->setDoesNotReturn();
+    boundsFail->addFnAttr(llvm::Attribute::Cold);
+
+    // The allocators return new memory of the size of their first argument,
+    // so it doesn't alias anything and its fields are known to be
+    // dereferenceable
+    for (const auto allocator :
+         {"GC_malloc",
+          "GC_malloc_atomic",
+          "GC_malloc_explicitly_typed",
+          "eva_region_alloc",
+          "eva_alloc"}) {
+        auto allocFn = module->getFunction(allocator);
+        allocFn->addRetAttr(llvm::Attribute::NoAlias);
+        allocFn->addFnAttr(
+            llvm::Attribute::getWithAllocSizeArgs(*context, 0, std::nullopt));
+    }
+    module->getFunction("eva_array_new")->addRetAttr(llvm::Attribute::NoAlias);
+
+    // the runtime is C, none of it unwinds
+    for (auto& function : *module) {
+        function.setDoesNotThrow();
+    }
+}
+
+/**
+ * Escape tracker: a pointer escapes if it's captured, unless it's passed to
+ * an argument of a generated function which doesn't let it escape either.
+ * The pointer can also be kept in a local variable (the arguments are always
+ * spilled to one), then the loads of the variable are tracked too.
+ */
+struct EscapeTracker : public llvm::CaptureTracker {
+    EscapeTracker(
+        const std::set<const llvm::Argument*>& noEscapeArgs, bool allowLocals)
+        : noEscapeArgs(noEscapeArgs), allowLocals(allowLocals) {}
+
+    void tooManyUses() override { escaped = true; }
+
+    bool captured(const llvm::Use* use) override {
+        // the fields are accessed with volatile loads and stores, which only
+        // use the address
+        if (llvm::isa<llvm::LoadInst>(use->getUser())) {
+            return false;
+        }
+        auto store = llvm::dyn_cast<llvm::StoreInst>(use->getUser());
+        if (store != nullptr && use->getOperandNo() == 1) {
+            return false;
+        }
+        // the pointer is the stored value, not the address
+        if (store != nullptr && allowLocals && use->getOperandNo() == 0) {
+            auto local = llvm::dyn_cast<llvm::AllocaInst>(
+                store->getPointerOperand());
+            if (local != nullptr && llvm::isAllocaPromotable(local)) {
+                if (locals.insert(local).second) {
+                    for (auto user : local->users()) {
+                        if (llvm::isa<llvm::LoadInst>(user)) {
+                            llvm::PointerMayBeCaptured(user, this);
+                        }
+                    }
+                }
+                return escaped;
+            }
+        }
+
+        // a tail call may reuse the stack frame of the caller
+        auto call = llvm::dyn_cast<llvm::CallInst>(use->getUser());
+        if (call != nullptr && call->isArgOperand(use) && !call->isTailCall()) {
+            auto callee = call->getCalledFunction();
+            if (callee != nullptr && !callee->isDeclaration() &&
+                noEscapeArgs.count(
+                    callee->getArg(call->getArgOperandNo(use)))) {
+                return false;
+            }
+        }
+        escaped = true;
+        return true;
+    }
+
+    const std::set<const llvm::Argument*>& noEscapeArgs;
+    const bool                             allowLocals;
+    std::set<const llvm::AllocaInst*>      locals;
+    bool                                   escaped = false;
+};
+
+/**
+ * Check the pointer is merged with another one, the stack slot is reused by
+ * the loop iterations, so the instance must be the only value of its uses
+ */
+static bool isMerged(const llvm::Value* ptr) {
+    for (const auto user : ptr->users()) {
+        if (llvm::isa<llvm::PHINode>(user) || llvm::isa<llvm::SelectInst>(user)) {
+            return true;
+        }
+        if (llvm::isa<llvm::GetElementPtrInst>(user) && isMerged(user)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Escape analysis: the class instances which never leave the function they
+ * are created in are allocated on the stack instead of the GC heap. It runs
+ * at every optimization level.
+ */
+void EvaLLVM::stackAllocateInstances() {
+
+    // 1. The pointer arguments which don't escape, it starts with all of them
+    // and drops the escaping ones until nothing changes, since the functions
+    // can call each other
+    std::set<const llvm::Argument*> noEscapeArgs;
+    for (const auto& function : *module) {
+        for (const auto& arg : function.args()) {
+            if (!function.isDeclaration() && arg.getType()->isPointerTy()) {
+                noEscapeArgs.insert(&arg);
+            }
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto it = noEscapeArgs.begin(); it != noEscapeArgs.end();) {
+            EscapeTracker tracker(noEscapeArgs, /* allowLocals */ true);
+            llvm::PointerMayBeCaptured(*it, &tracker);
+            if (tracker.escaped) {
+                it = noEscapeArgs.erase(it);
+                changed = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // 2. Replace the allocations which don't escape with the entry block
+    // allocas, zeroed like the GC memory
+    std::map<llvm::Function*, std::vector<llvm::CallInst*>> allocations;
+    for (const auto allocator :
+         {"GC_malloc",
+          "GC_malloc_atomic",
+          "GC_malloc_explicitly_typed",
+          "eva_region_alloc",
+          "eva_alloc"}) {
+        auto gcMalloc = module->getFunction(allocator);
+        if (gcMalloc == nullptr) {
+            continue;
+        }
+        for (auto user : gcMalloc->users()) {
+            auto call = llvm::dyn_cast<llvm::CallInst>(user);
+            if (call != nullptr && call->getCalledFunction() == gcMalloc &&
+                llvm::isa<llvm::ConstantInt>(call->getArgOperand(0))) {
+                allocations[call->getFunction()].push_back(call);
+            }
+        }
+    }
+    for (const auto& [function, calls] : allocations) {
+        // in a loop the stack slot is reused by every iteration, so the
+        // instance must not outlive it in a local variable
+        llvm::DominatorTree dominatorTree(*function);
+        llvm::LoopInfo      loopInfo(dominatorTree);
+        for (auto call : calls) {
+            EscapeTracker tracker(
+                noEscapeArgs, !loopInfo.getLoopFor(call->getParent()));
+            llvm::PointerMayBeCaptured(call, &tracker);
+            if (!tracker.escaped && !isMerged(call)) {
+                moveInstanceToStack(call);
+            }
+        }
+    }
+    builder->ClearInsertionPoint();
+}
+
+/**
+ * Replace a GC allocation with an entry block alloca
+ */
+void EvaLLVM::moveInstanceToStack(llvm::CallInst* call) {
+    auto  function = call->getFunction();
+    auto& entry = function->getEntryBlock();
+    auto  size = call->getArgOperand(0);
+    varsBuilder->SetInsertPoint(&entry, entry.begin());
+    auto instance = varsBuilder->CreateAlloca(
+        builder->getInt8Ty(), size, call->getName() + ".stack");
+    instance->setAlignment(llvm::Align(8));
+
+    // GC_malloc_atomic is already followed by one
+    if (call->getCalledFunction()->getName() != "GC_malloc_atomic") {
+        builder->SetInsertPoint(call);
+        builder->CreateMemSet(
+            instance, builder->getInt8(0), size, llvm::MaybeAlign(8));
+    }
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Instance allocated on the stack: %s in %s\n",
+        call->getName().str().c_str(),
+        function->getName().str().c_str());
+    call->replaceAllUsesWith(instance);
+    call->eraseFromParent();
+}
+
+/**
+ * Memory effects of a generated function, ordered from none to any
+ */
+enum class MemoryEffect { None, Read, Any };
+
+/**
+ * Check the memory of an access is local to the function, i.e. one of its
+ * variables or stack allocated instances
+ */
+static bool isLocalMemory(const llvm::Value* ptr) {
+    return llvm::isa<llvm::AllocaInst>(llvm::getUnderlyingObject(ptr));
+}
+
+/**
+ * Memory effect of an instruction, the calls of the generated functions
+ * have the effects found for them so far
+ */
+static MemoryEffect getMemoryEffect(
+    const llvm::Instruction&                            instruction,
+    const std::map<const llvm::Function*, MemoryEffect>& effects) {
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(&instruction)) {
+        if (load->isVolatile()) {
+            return MemoryEffect::Any;
+        }
+        return isLocalMemory(load->getPointerOperand()) ? MemoryEffect::None
+                                                        : MemoryEffect::Read;
+    }
+    if (auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction)) {
+        return !store->isVolatile() && isLocalMemory(store->getPointerOperand())
+            ? MemoryEffect::None
+            : MemoryEffect::Any;
+    }
+    if (auto call = llvm::dyn_cast<llvm::CallBase>(&instruction)) {
+        auto callee = effects.find(call->getCalledFunction());
+        if (callee != effects.end()) {
+            return callee->second;
+        }
+        if (call->doesNotAccessMemory()) {
+            return MemoryEffect::None;
+        }
+        // e.g. the memset of a stack allocated instance
+        if (call->onlyAccessesArgMemory() &&
+            std::all_of(call->arg_begin(), call->arg_end(), [](auto& arg) {
+                return !arg->getType()->isPointerTy() || isLocalMemory(arg);
+            })) {
+            return MemoryEffect::None;
+        }
+        return call->onlyReadsMemory() ? MemoryEffect::Read : MemoryEffect::Any;
+    }
+    if (instruction.mayWriteToMemory()) {
+        return MemoryEffect::Any;
+    }
+    return instruction.mayReadFromMemory() ? MemoryEffect::Read
+                                           : MemoryEffect::None;
+}
+
+/**
+ * Attributes of the generated functions, so the optimizer can inline, hoist
+ * and eliminate their calls without analyzing them first, and at -O0 the
+ * code generator sees them too:
+ *
+ * - the memory effects: none for the functions computing only on their
+ *   variables, read for the ones also reading the globals or the arrays. It
+ *   starts with none for all the functions and raises their effects until
+ *   nothing changes, since the functions can call each other. The pure
+ *   functions defined by the other partitions are known from their AST.
+ *
+ * - self of the methods is an instance, so it's nonnull and dereferenceable
+ *   for the size of the class, the subclasses are only bigger.
+ */
+void EvaLLVM::inferFunctionAttributes() {
+    std::map<const llvm::Function*, MemoryEffect> effects;
+    for (const auto& function : *module) {
+        if (!function.isDeclaration()) {
+            effects[&function] = MemoryEffect::None;
+        } else if (isPureFunction(function.getName().str())) {
+            effects[&function] = MemoryEffect::None;
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto& [function, effect] : effects) {
+            if (function->isDeclaration() || effect == MemoryEffect::Any) {
+                continue;
+            }
+            for (const auto& instruction : llvm::instructions(*function)) {
+                const auto instructionEffect =
+                    getMemoryEffect(instruction, effects);
+                if (instructionEffect > effect) {
+                    effect = instructionEffect;
+                    changed = true;
+                }
+            }
+        }
+    }
+    for (auto& [function, effect] : effects) {
+        auto fn = const_cast<llvm::Function*>(function);
+        if (effect == MemoryEffect::None) {
+            fn->setDoesNotAccessMemory();
+        } else if (effect == MemoryEffect::Read) {
+            fn->setOnlyReadsMemory();
+        }
+    }
+
+    for (const auto& [className, classInfo] : classMap_) {
+        const auto size =
+            module->getDataLayout().getTypeAllocSize(classInfo.classType);
+        for (const auto& [methodName, method] : classInfo.methodTypes) {
+            // the inherited methods get the attributes of their class
+            if (method == nullptr || method->getParent() != module.get() ||
+                method->getName() != className + "_" + methodName) {
+                continue;
+            }
+            method->addParamAttr(0, llvm::Attribute::NonNull);
+            method->addDereferenceableParamAttr(0, size);
+        }
+    }
+}
+
+/**
+ * Optimize the module with the default pipeline of the optimization level
+ */
+void EvaLLVM::optimizeModule() {
+    stackAllocateInstances();
+    inferFunctionAttributes();
+    if (options_.optLevel == 0) {
+        return;
+    }
+
+    llvm::LoopAnalysisManager     lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager    cgam;
+    llvm::ModuleAnalysisManager   mam;
+
+    // the target cost model, e.g. the vector width for the vectorizers
+    llvm::PassBuilder passBuilder(targetMachine.get());
+    passBuilder.registerModuleAnalyses(mam);
+    passBuilder.registerCGSCCAnalyses(cgam);
+    passBuilder.registerFunctionAnalyses(fam);
+    passBuilder.registerLoopAnalyses(lam);
+    passBuilder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    // The default pipelines promote the allocas to registers (SROA), and
+    // run GVN, the inliner and the loop passes
+    const llvm::OptimizationLevel levels[] = {
+        llvm::OptimizationLevel::O0,
+        llvm::OptimizationLevel::O1,
+        llvm::OptimizationLevel::O2,
+        llvm::OptimizationLevel::O3};
+    auto mpm = passBuilder.buildPerModuleDefaultPipeline(
+        levels[std::min(options_.optLevel, 3u)]);
+    mpm.run(*module, mam);
 }
 
 /**
  * Save the IR to a file
  */
 void EvaLLVM::saveModuleToFile(const std::string& fileName) {
+    switch (getOutputKind(fileName)) {
+    case OutputKind::IR: {
+        std::error_code      errorCode;
+        llvm::raw_fd_ostream outLL(fileName, errorCode);
+        module->print(outLL, nullptr);
+        break;
+    }
+    case OutputKind::Bitcode:
+        emitBitcodeFile(fileName);
+        break;
+    case OutputKind::Object:
+        emitObjectFile(fileName);
+        break;
+    default: {
+        // Executable, linked against libgc
+        const auto objFileName = fileName + ".o";
+        emitObjectFile(objFileName);
+        linkExecutable({objFileName}, fileName);
+        llvm::sys::fs::remove(objFileName);
+        break;
+    }
+    }
+}
+
+/**
+ * Output kind names, as in --emit
+ */
+const char* EvaLLVM::outputKindNames[] = {"auto", "ll", "bc", "obj", "exe"};
+
+/**
+ * Get the output kind from the options or from the file extension
+ */
+OutputKind EvaLLVM::getOutputKind(const std::string& fileName) {
+    if (options_.output != OutputKind::Auto) {
+        return options_.output;
+    }
+    const auto extension = llvm::sys::path::extension(fileName);
+    if (extension == ".ll") {
+        return OutputKind::IR;
+    }
+    if (extension == ".bc") {
+        return OutputKind::Bitcode;
+    }
+    if (extension == ".o") {
+        return OutputKind::Object;
+    }
+    return OutputKind::Executable;
+}
+
+/**
+ * Write the module bitcode, it's streamed straight into the file
+ */
+void EvaLLVM::emitBitcodeFile(const std::string& fileName) {
+    std::error_code      errorCode;
+    llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+    if (errorCode) {
+        throw std::runtime_error(
+            "Can't open " + fileName + ": " + errorCode.message());
+    }
+
+    if (!options_.moduleSummary) {
+        llvm::WriteBitcodeToFile(*module, out);
+        return;
+    }
+
+    // The summary lets the bitcode go straight into the ThinLTO link
+    llvm::ProfileSummaryInfo psi(*module);
+    const auto               index =
+        llvm::buildModuleSummaryIndex(*module, nullptr, &psi);
+    llvm::WriteBitcodeToFile(*module, out, false, &index);
+}
+
+/**
+ * Emit the native object file for the module
+ */
+void EvaLLVM::emitObjectFile(const std::string& fileName) {
     std::error_code      errorCode;
-    llvm::raw_fd_ostream outLL(fileName, errorCode);
-    module->print(outLL, nullptr);
+    llvm::raw_fd_ostream out(fileName, errorCode, llvm::sys::fs::OF_None);
+    if (errorCode) {
+        throw std::runtime_error(
+            "Can't open " + fileName + ": " + errorCode.message());
+    }
+
+    llvm::legacy::PassManager passManager;
+    if (targetMachine->addPassesToEmitFile(
+            passManager, out, nullptr, llvm::CGFT_ObjectFile)) {
+        throw std::runtime_error("The target can't emit object files");
+    }
+    passManager.run(*module);
+    out.flush();
+}
+
+/**
+ * Link the object files into an executable with the system C compiler driver
+ */
+void EvaLLVM::linkExecutable(
+    const std::vector<std::string>& objFileNames,
+    const std::string&              exeFileName) {
+    auto linker = llvm::sys::findProgramByName("cc");
+    if (!linker) {
+        throw std::runtime_error("Linker is not found: cc");
+    }
+
+    std::vector<llvm::StringRef> args = {*linker};
+    args.insert(args.end(), objFileNames.begin(), objFileNames.end());
+    args.insert(args.end(), {EVA_RUNTIME_LIB, "-lgc", "-o", exeFileName});
+
+    std::string error;
+    if (llvm::sys::ExecuteAndWait(*linker, args, {}, {}, 0, 0, &error) != 0) {
+        throw std::runtime_error(
+            "Linking " + exeFileName + " failed: " + error);
+    }
 }
 
-EvaLLVM::EvaLLVM() {
+EvaLLVM::EvaLLVM(const EvaOptions& options) : options_(options) {
     moduleInit();
     setupExternalFunctions();
     setupGlobalEnvironment();
     setupTargetTriple();
+    if (!options_.cacheDir.empty()) {
+        cache = std::make_unique<EvaCache>(options_.cacheDir);
+    }
+    if (options_.stats != StatsFormat::None) {
+        stats = std::make_unique<EvaStats>();
+    }
 };
 
 EvaLLVM::~EvaLLVM() {
@@ -1383,8 +4738,11 @@ void EvaLLVM::addFieldToClass(
         throw std::runtime_error(e.c_str());
     }
 
-    dprintf(
-        "Adding field to class: %s.%s\n", className.c_str(), fieldName.c_str());
+    EVA_TRACE(
+        TRACE_CLASS,
+        "Adding field to class: %s.%s\n",
+        className.c_str(),
+        fieldName.c_str());
     classMap_[className].fieldNames.push_back(fieldName);
     classMap_[className].fieldTypes[fieldName] = {fieldType, ptrType};
 }
@@ -1396,7 +4754,8 @@ void EvaLLVM::addMethodToClass(
     const std::string& className,
     const std::string& methodName,
     llvm::Function*    method) {
-    dprintf(
+    EVA_TRACE(
+        TRACE_CLASS,
         "Adding method to class: %s.%s\n",
         className.c_str(),
         methodName.c_str());
@@ -1439,9 +4798,14 @@ EvaLLVM::serializeMethodTypes(const std::string& className) {
 }
 
 void EvaLLVM::moduleInit() {
-    context = std::make_unique<llvm::LLVMContext>();
+    threadSafeContext =
+        llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+    context = threadSafeContext.getContext();
     module = std::make_unique<llvm::Module>("EvaLLVM", *context);
     builder = std::make_unique<llvm::IRBuilder<>>(*context);
+    if (options_.fastMath) {
+        builder->setFastMathFlags(llvm::FastMathFlags::getFast());
+    }
     varsBuilder = std::make_unique<llvm::IRBuilder<>>(*context);
     parser = std::make_unique<syntax::EvaParser>();
 }
@@ -2,13 +2,16 @@
 #define EvaLLVM_h
 
 #include "TypesMisc.h"
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
 #include <map>
+#include <set>
 
 // Forward declarations for EvaParser.h
-enum class ExpType;
+enum class ExpType : uint8_t;
 struct Exp;
 namespace syntax {
 class EvaParser;
@@ -17,8 +20,86 @@ class EvaParser;
 // Forward declarations for Environment.h
 class Environment;
 
+// Forward declarations for EvaCache.h
+class EvaCache;
+
+// Forward declarations for EvaStats.h
+class EvaStats;
+
 using Env = std::shared_ptr<Environment>;
 
+/**
+ * Output file kind
+ */
+enum class OutputKind {
+    Auto, // by the output file extension
+    IR,
+    Bitcode,
+    Object,
+    Executable,
+};
+
+/**
+ * Compiler statistics report format
+ */
+enum class StatsFormat {
+    None, // no report
+    Text,
+    JSON,
+};
+
+/**
+ * Compiler options
+ */
+struct EvaOptions {
+    /**
+     * Optimization level, 0 (no optimizations) to 3
+     */
+    unsigned optLevel = 0;
+
+    /**
+     * Output file kind
+     */
+    OutputKind output = OutputKind::Auto;
+
+    /**
+     * Embed the module summary into the bitcode, for ThinLTO
+     */
+    bool moduleSummary = false;
+
+    /**
+     * Compile each function on its first call in the JIT mode
+     */
+    bool lazyJIT = false;
+
+    /**
+     * Fast-math flags on the floating point operations, they may be
+     * reassociated, e.g. for the vectorization of the reductions
+     */
+    bool fastMath = false;
+
+    /**
+     * Number of partitions generated in parallel, 1 compiles the whole
+     * program in one module
+     */
+    unsigned jobs = 1;
+
+    /**
+     * Directory of the compiled outputs cache, empty disables the cache
+     */
+    std::string cacheDir;
+
+    /**
+     * Report of the phases time and the program statistics
+     */
+    StatsFormat stats = StatsFormat::None;
+
+    /**
+     * File the statistics report is written to, stderr if empty
+     */
+    std::string statsFile;
+};
+
 /**
  * Class information
  */
@@ -30,19 +111,26 @@ struct ClassInfo {
     std::map<std::string, TypeType>        fieldTypes;
     std::vector<std::string>               methodNames;
     std::map<std::string, llvm::Function*> methodTypes;
+    llvm::GlobalVariable*                  vtable = nullptr;
+};
+
+/**
+ * Class declaration of the whole program, for the class hierarchy analysis
+ */
+struct ClassDecl {
+    std::string           parent;
+    std::set<std::string> methods;
 };
 
 std::string exp_type2str(ExpType type);
 std::string exp2str(const Exp& exp);
 
-void dprintf(const char* fmt, ...);
-
 template <typename T> std::string dumpValueToString(const T* V);
 
 class EvaLLVM {
 
   public:
-    EvaLLVM();
+    EvaLLVM(const EvaOptions& options = {});
     ~EvaLLVM();
 
     void setupTargetTriple();
@@ -51,13 +139,30 @@ class EvaLLVM {
         const std::string& program,
         const std::string& fileName = "./output.ll");
 
+    int run(const std::string& program);
+
+    void evalIncremental(const std::string& input);
+
+    void printStats();
+
   private:
+    /**
+     * Compiler options
+     */
+    EvaOptions options_;
+
+    /**
+     * Owner of the global LLVM context, it's shared with the modules handed
+     * over to the JIT
+     */
+    llvm::orc::ThreadSafeContext threadSafeContext;
+
     /**
      * Global LLVM context
      * It owns and manages the core "global" data of LLVM's core
      * infrastructure, including the type and constant uniquing tables.
      */
-    std::unique_ptr<llvm::LLVMContext> context;
+    llvm::LLVMContext* context = nullptr;
 
     /**
      * A module represents a single translation unit of code.
@@ -75,6 +180,11 @@ class EvaLLVM {
      */
     std::unique_ptr<llvm::IRBuilder<>> varsBuilder;
 
+    /**
+     * The host target machine, it emits the native code
+     */
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+
     /**
      * The current function
      */
@@ -100,11 +210,189 @@ class EvaLLVM {
      */
     std::map<std::string, ClassInfo> classMap_;
 
+    /**
+     * All the classes of the program, known before any of them is compiled
+     */
+    std::map<std::string, ClassDecl> classHierarchy_;
+
+    /**
+     * Element type of the array header types, e.g. array.double
+     */
+    std::map<llvm::Type*, TypeType> arrayElements_;
+
+    /**
+     * Functions by the symbol id of their name
+     */
+    std::vector<llvm::Function*> functions_;
+
+    /**
+     * Nesting of the expressions being generated, the trace messages are
+     * indented by it
+     */
+    unsigned traceDepth_ = 0;
+
+    int traceIndent() const { return traceDepth_ * 2; }
+
+    /**
+     * The JIT for the run and the REPL modes, created on the first use
+     */
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+
+    /**
+     * Cache of the compiled outputs, nullptr if disabled
+     */
+    std::unique_ptr<EvaCache> cache;
+
+    /**
+     * Compiler statistics, nullptr if disabled
+     */
+    std::unique_ptr<EvaStats> stats;
+
+    /**
+     * Number of the REPL inputs, it makes the entry function names unique
+     */
+    size_t replInputs_ = 0;
+
+    /**
+     * Regions the code being generated is lexically in
+     */
+    unsigned regionDepth_ = 0;
+
+    /**
+     * The program has regions, so its functions may be called in one
+     */
+    bool usesRegions_ = false;
+
+    /**
+     * The code being generated may run in a region, it's in a function
+     */
+    bool maybeInRegion_ = false;
+
+    /**
+     * Tail calls of the function being generated
+     */
+    struct TailCalls {
+        std::set<const Exp*>           exps; // in the tail position
+        llvm::BasicBlock*              loop = nullptr; // the self calls jump to
+        std::vector<llvm::AllocaInst*> args; // assigned by the self calls
+    };
+    TailCalls tailCalls_;
+
+    /**
+     * Jump targets of the loops the code being generated is in, the
+     * innermost last
+     */
+    struct LoopTargets {
+        llvm::BasicBlock* breakBB = nullptr;
+        llvm::BasicBlock* continueBB = nullptr;
+        unsigned          regionDepth = 0; // can't be left by a jump
+    };
+    std::vector<LoopTargets> loops_;
+
+    /**
+     * Access groups of the parallel loops the code being generated is in,
+     * their array elements don't depend on the other iterations
+     */
+    std::vector<llvm::MDNode*> accessGroups_;
+
+    /**
+     * Variables of a block evaluated at compile time, the variable of a for
+     * loop can't be set
+     */
+    struct ConstScope {
+        std::map<std::string, llvm::Constant*> vars;
+        ConstScope*                            parent = nullptr;
+        std::string                            loopVar; // of a for loop
+
+        /**
+         * Scope of a variable, nullptr if it isn't defined
+         */
+        ConstScope* find(const std::string& name) {
+            for (auto scope = this; scope != nullptr; scope = scope->parent) {
+                if (scope->vars.count(name) != 0) {
+                    return scope;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    /**
+     * Definitions of the top-level functions by name, the pure ones are
+     * evaluated at compile time when their arguments are constants
+     */
+    std::map<std::string, const Exp*> defExps_;
+
+    /**
+     * Purity of the functions by name, checked on their first call
+     */
+    std::map<std::string, bool> pureFunctions_;
+
+    /**
+     * Budget of the compile-time evaluation: the expressions left to
+     * evaluate, and the depth of the calls and the loops
+     */
+    size_t   constEvalSteps_ = 0;
+    unsigned constEvalDepth_ = 0;
+    unsigned constEvalLoops_ = 0;
+
+    /**
+     * Modules of the previous REPL inputs, the environment references their
+     * functions and globals
+     */
+    std::vector<std::unique_ptr<llvm::Module>> replModules_;
+
+    /**
+     * Special form handler
+     */
+    using GenHandler = ValueType (EvaLLVM::*)(const Exp& exp, Env env);
+
+    /**
+     * Special form handlers, indexed by the keyword symbol id
+     */
+    static const std::vector<GenHandler> genHandlers_;
+
   private:
     void moduleInit();
 
     void setupGlobalEnvironment();
 
+    static const char* outputKindNames[];
+
+    std::string getCacheKey(const std::string& program, llvm::StringRef kind);
+
+    Exp parseProgram(const std::string& program);
+
+    void countModule(const llvm::Module& module);
+
+    void evalSerial(const std::string& program, const std::string& fileName);
+
+    void evalParallel(const std::string& program, const std::string& fileName);
+
+    std::vector<unsigned> partitionForms(const Exp& ast, unsigned partitions);
+
+    void compilePartition(
+        const Exp& ast, const std::vector<unsigned>& owners, unsigned partition);
+
+    bool buildModule(const std::string& program);
+
+    int runModule();
+
+    void initJIT(llvm::ObjectCache* objectCache = nullptr);
+
+    std::unique_ptr<llvm::orc::LLJIT>
+    createJIT(llvm::ObjectCache* objectCache);
+
+    void addModuleToJIT(std::unique_ptr<llvm::Module> jitModule);
+
+    int callJITFunction(const std::string& fnName);
+
+    void nextModule();
+
+    llvm::Value* importValue(llvm::Value* value);
+
+    llvm::GlobalVariable* getVtable(const std::string& className);
+
     void compile(const Exp& ast);
 
     llvm::Function* createFunction(
@@ -113,6 +401,9 @@ class EvaLLVM {
     llvm::Function* createFunctionProto(
         const std::string& fnName, llvm::FunctionType* fnType, Env env);
 
+    llvm::GlobalValue::LinkageTypes
+    getFunctionLinkage(const std::string& fnName);
+
     void createFunctionBlock(llvm::Function* fn);
 
     llvm::BasicBlock*
@@ -120,6 +411,96 @@ class EvaLLVM {
 
     ValueType gen(const Exp& exp, Env env);
 
+    ValueType genSymbol(const Exp& exp, Env env);
+
+    ValueType genPrintf(const Exp& exp, Env env);
+
+    ValueType genVar(const Exp& exp, Env env);
+
+    ValueType genBegin(const Exp& exp, Env env);
+
+    ValueType genRegion(const Exp& exp, Env env);
+
+    ValueType genSet(const Exp& exp, Env env);
+
+    ValueType genArithmetic(const Exp& exp, Env env);
+
+    llvm::Value*
+    createArithmetic(uint32_t op, llvm::Value* lhs, llvm::Value* rhs);
+
+    ValueType genComparison(const Exp& exp, Env env);
+
+    llvm::Value*
+    createComparison(uint32_t op, llvm::Value* lhs, llvm::Value* rhs);
+
+    ValueType genVector(const Exp& exp, Env env);
+
+    ValueType genLane(const Exp& exp, Env env);
+
+    ValueType genShuffle(const Exp& exp, Env env);
+
+    ValueType genReduce(const Exp& exp, Env env);
+
+    ValueType genArray(const Exp& exp, Env env);
+
+    ValueType genAt(const Exp& exp, Env env);
+
+    ValueType genPush(const Exp& exp, Env env);
+
+    ValueType genLen(const Exp& exp, Env env);
+
+    ValueType genIf(const Exp& exp, Env env);
+
+    ValueType genWhile(const Exp& exp, Env env);
+
+    ValueType genFor(const Exp& exp, Env env);
+
+    ValueType genBreak(const Exp& exp, Env env);
+
+    llvm::MDNode* getLoopMetadata(
+        const Exp& exp, llvm::ConstantInt* step, llvm::MDNode* accessGroup);
+
+    ValueType genDef(const Exp& exp, Env env);
+
+    ValueType genClass(const Exp& exp, Env env);
+
+    ValueType genProp(const Exp& exp, Env env);
+
+    ValueType genMethod(const Exp& exp, Env env);
+
+    ValueType genCall(const Exp& exp, Env env);
+
+    ValueType
+    genTailCall(llvm::Function* callee, const std::vector<llvm::Value*>& args);
+
+    ValueType genConstEval(const Exp& exp, Env env);
+
+    void registerDef(const Exp& exp);
+
+    bool isPureFunction(const std::string& name);
+
+    bool isPureExp(const Exp& exp, std::set<std::string>& names);
+
+    llvm::Constant* foldPureCall(
+        const Exp&                       exp,
+        llvm::Function*                  callee,
+        const std::vector<llvm::Value*>& args);
+
+    llvm::Constant* evalConst(const Exp& exp, ConstScope& scope);
+
+    llvm::Constant* evalConstCall(
+        const Exp&                          def,
+        llvm::Function*                     callee,
+        const std::vector<llvm::Constant*>& args);
+
+    llvm::Type* inferConstType(const Exp& exp, ConstScope& scope);
+
+    void reportConstEval(const Exp& exp, llvm::Constant* value);
+
+    llvm::Function* getFunctionBySymbol(uint32_t symbol);
+
+    void registerFunction(const std::string& name, llvm::Function* fn);
+
     ValueType
     accessProperty(const Exp& exp, Env env, llvm::Value* newValue = nullptr);
 
@@ -134,16 +515,50 @@ class EvaLLVM {
     llvm::Value*
     mallocInsance(llvm::StructType* classType, const std::string& name);
 
+    std::vector<uint64_t> getPointerBitmap(llvm::StructType* classType);
+
+    llvm::Function* getGcDescriptor(
+        llvm::StructType* classType, const std::vector<uint64_t>& bitmap);
+
     size_t getTypeSize(llvm::Type* type);
 
     void createClass(const Exp& exp, Env env);
 
+    void declareClass(const Exp& exp, Env env);
+
+    void defineClassMethods(const Exp& exp, Env env);
+
+    void declareFunction(const Exp& exp, Env env);
+
     void buildClassInfo(llvm::StructType* classType, const Exp& exp, Env env);
 
     void inheritClass(llvm::StructType* classType, const std::string& name);
 
     llvm::StructType* getClassByName(const std::string& name);
 
+    llvm::Type* getBuiltinType(const Exp& type);
+
+    llvm::FixedVectorType* getVectorType(const Exp& type);
+
+    llvm::StructType* getArrayType(const Exp& type);
+
+    llvm::StructType* getArrayTypeOf(const ValueType& array, const Exp& exp);
+
+    llvm::Value* genElementPtr(const Exp& exp, Env env, TypeType& element);
+
+    llvm::Value* loadArrayField(
+        llvm::StructType* arrayType, llvm::Value* array, unsigned index);
+
+    void storeArrayField(
+        llvm::StructType* arrayType,
+        llvm::Value*      array,
+        unsigned          index,
+        llvm::Value*      value);
+
+    llvm::MDNode* getArrayTBAA(const std::string& name);
+
+    void tagElementAccess(llvm::Instruction* access, llvm::Type* elementType);
+
     llvm::Type* getRetType(const Exp& exp);
 
     std::vector<llvm::Type*> getArgTypes(const Exp& exp);
@@ -162,8 +577,26 @@ class EvaLLVM {
 
     void setupExternalFunctions();
 
+    void stackAllocateInstances();
+
+    void moveInstanceToStack(llvm::CallInst* call);
+
+    void inferFunctionAttributes();
+
+    void optimizeModule();
+
     void saveModuleToFile(const std::string& fileName);
 
+    OutputKind getOutputKind(const std::string& fileName);
+
+    void emitBitcodeFile(const std::string& fileName);
+
+    void emitObjectFile(const std::string& fileName);
+
+    void linkExecutable(
+        const std::vector<std::string>& objFileNames,
+        const std::string&              exeFileName);
+
     void addFieldToClass(
         const std::string& className,
         const std::string& fieldName,
@@ -184,13 +617,31 @@ class EvaLLVM {
         const std::string& methodName,
         const std::string& className);
 
+    void scanClassHierarchy(const Exp& exp);
+
+    llvm::Function*
+    devirtualize(const std::string& className, const std::string& methodName);
+
     llvm::Value* getCallable(const Exp& exp, Env env);
 
-    std::vector<llvm::Value*>
-    genFunctionArgs(const Exp& exp, size_t start, Env env);
+    std::vector<llvm::Value*> genFunctionArgs(
+        const Exp& exp, size_t start, Env env, llvm::FunctionType* fnType);
+
+    std::vector<llvm::Value*> genMethodArgs(
+        llvm::Value*        inst,
+        const Exp&          exp,
+        size_t              start,
+        Env                 env,
+        llvm::FunctionType* fnType);
+
+    llvm::Value*
+    castArg(llvm::Value* arg, llvm::FunctionType* fnType, size_t index);
+
+    llvm::Type* getCommonType(llvm::Type* lhs, llvm::Type* rhs);
+
+    void promoteOperands(llvm::Value*& lhs, llvm::Value*& rhs);
 
-    std::vector<llvm::Value*>
-    genMethodArgs(llvm::Value* inst, const Exp& exp, size_t start, Env env);
+    llvm::Value* castNumber(llvm::Value* value, llvm::Type* type);
 
     ClassInfo* getClassInfoByVarName(const std::string& varName, Env env);
 };
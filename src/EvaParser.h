@@ -1,18 +1,24 @@
 /**
- * LR parser for C++ generated by the Syntax tool.
+ * LR parser of Eva, first generated by the Syntax tool from EvaGrammar.bnf,
+ * now maintained by hand. The tokenizer is hand-written and the parsing
+ * table and the productions are constexpr arrays, regenerating this file
+ * with syntax-cli would bring back the regex tokenizer and the map tables.
  *
  * https://www.npmjs.com/package/syntax-cli
  *
- *   npm install -g syntax-cli
+ * The grammar file stays the reference, a change of the grammar is made in
+ * both files:
  *
- *   syntax-cli --help
+ *   - the lexical rules: Tokenizer::scan_() and the character classes,
+ *   - the prologue between %{ and %}: the module include prologue below,
+ *   - the syntactic rules: the LALR1 table of a scratch parser
  *
- * To regenerate run:
+ *       syntax-cli -g src/EvaGrammar.bnf -m LALR1 -o /tmp/EvaParser.h
  *
- *   syntax-cli \
- *     --grammar ~/path-to-grammar-file \
- *     --mode <parsing-mode> \
- *     --output ~/ParserClassName.h
+ *     is copied into productions_ (the encoded LHS, the RHS length and the
+ *     handler) and table_ (s(state), r(production), t(state), acc or err
+ *     for each state and encoded symbol), and its semantic actions into the
+ *     _handlerN functions.
  */
 #ifndef __Syntax_LR_Parser_h
 #define __Syntax_LR_Parser_h
@@ -23,11 +29,10 @@
 #include <assert.h>
 #include <array>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ------------------------------------
@@ -50,46 +55,291 @@
 //   }
 //
 // clang-format off
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 /**
  * Expression type.
  */
-enum class ExpType {
+enum class ExpType : uint8_t {
   NUMBER = 0,
   STRING,
   SYMBOL,
   LIST,
 };
 
+/**
+ * Number type, by the literal syntax.
+ */
+enum class NumberType : uint8_t {
+  I32, // 42
+  I64, // 42L
+  F64, // 4.2
+};
+
+/**
+ * Symbols with a special meaning in the language. They are interned first,
+ * so the symbol id of a keyword is its enum value.
+ */
+enum Keyword : uint32_t {
+  KW_PRINTF,
+  KW_VAR,
+  KW_BEGIN,
+  KW_SET,
+  KW_ADD,
+  KW_SUB,
+  KW_MUL,
+  KW_DIV,
+  KW_EQ,
+  KW_NE,
+  KW_LT,
+  KW_LE,
+  KW_GT,
+  KW_GE,
+  KW_IF,
+  KW_WHILE,
+  KW_DEF,
+  KW_CLASS,
+  KW_PROP,
+  KW_METHOD,
+  KW_NEW,
+  KW_TRUE,
+  KW_FALSE,
+  KW_SELF,
+  KW_ARROW,
+  KW_REGION,
+  KW_VEC2,
+  KW_VEC4,
+  KW_VEC8,
+  KW_VEC16,
+  KW_LANE,
+  KW_SHUFFLE,
+  KW_REDUCE,
+  KW_ARRAY,
+  KW_AT,
+  KW_PUSH,
+  KW_LEN,
+  KW_FOR,
+  KW_PARALLEL_FOR,
+  KW_BREAK,
+  KW_CONTINUE,
+  KW_CONST_EVAL,
+  KEYWORDS_COUNT,
+};
+
+inline constexpr std::array<std::string_view, KEYWORDS_COUNT> keywordNames = {
+  "printf", "var", "begin", "set", "+", "-", "*", "/", "==", "!=", "<", "<=",
+  ">", ">=", "if", "while", "def", "class", "prop", "method", "new", "true",
+  "false", "self", "->", "region", "vec2", "vec4", "vec8", "vec16", "lane",
+  "shuffle", "reduce", "array", "at", "push", "len", "for", "parallel-for",
+  "break", "continue", "const-eval",
+};
+
+/**
+ * Symbol table: maps symbol names to dense ids.
+ */
+class SymbolTable {
+ public:
+  static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+  SymbolTable() {
+    for (auto name : keywordNames) {
+      intern(name);
+    }
+  }
+
+  uint32_t intern(std::string_view name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    uint32_t id = names_.size();
+    names_.emplace_back(name);
+    ids_.emplace(names_.back(), id);
+    return id;
+  }
+
+  std::string_view name(uint32_t id) const { return names_[id]; }
+
+  size_t size() const { return names_.size(); }
+
+ private:
+  std::deque<std::string> names_;
+  std::unordered_map<std::string_view, uint32_t> ids_;
+};
+
+struct Exp;
+
+/**
+ * List elements: a span of nodes stored contiguously in the ExpArena.
+ */
+struct ExpList {
+  const Exp* data_ = nullptr;
+  uint32_t size_ = 0;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const Exp& operator[](size_t i) const;
+  const Exp* begin() const { return data_; }
+  const Exp* end() const;
+};
+
 /**
  * Expression.
+ *
+ * A fixed-size, trivially copyable node. Strings and symbols point into the
+ * source buffer kept by the ExpArena, lists point to their elements in it.
+ * Symbols also carry their id in the SymbolTable.
  */
 struct Exp {
   ExpType type;
 
-  int number;
-  std::string string;
-  std::vector<Exp> list;
+  NumberType numberType = NumberType::I32;
+
+  uint32_t symbol = SymbolTable::NO_SYMBOL;
+
+  union {
+    int number;
+    int64_t integer;
+    double real;
+    std::string_view string;
+    ExpList list;
+  };
+
+  Exp() : type(ExpType::LIST), list() {}
 
   // Numbers:
   Exp(int number) : type(ExpType::NUMBER), number(number) {}
 
-  // Strings, Symbols:
-  Exp(std::string& strVal) {
-    if (strVal[0] == '"') {
-      type = ExpType::STRING;
-      string = strVal.substr(1, strVal.size() - 2);
-    } else {
-      type = ExpType::SYMBOL;
-      string = strVal;
+  Exp(int64_t integer)
+      : type(ExpType::NUMBER), numberType(NumberType::I64), integer(integer) {}
+
+  Exp(double real)
+      : type(ExpType::NUMBER), numberType(NumberType::F64), real(real) {}
+
+  // Strings:
+  Exp(std::string_view strVal)
+      : type(ExpType::STRING), string(strVal.substr(1, strVal.size() - 2)) {}
+
+  // Symbols:
+  Exp(std::string_view name, uint32_t symbol)
+      : type(ExpType::SYMBOL), symbol(symbol), string(name) {}
+
+  // Lists:
+  Exp(ExpList list) : type(ExpType::LIST), list(list) {}
+
+  /**
+   * Whether it's the given symbol.
+   */
+  bool is(uint32_t id) const {
+    return type == ExpType::SYMBOL && symbol == id;
+  }
+
+};
+
+inline const Exp& ExpList::operator[](size_t i) const { return data_[i]; }
+inline const Exp* ExpList::end() const { return data_ + size_; }
+
+/**
+ * Parses a number of the type.
+ */
+template <typename T> T parseNumber(std::string_view token) {
+  T number = 0;
+  auto [ptr, ec] =
+      std::from_chars(token.data(), token.data() + token.size(), number);
+  if (ec == std::errc::result_out_of_range) {
+    throw std::out_of_range("Number is out of range: " + std::string(token));
+  }
+  return number;
+}
+
+/**
+ * Parses a NUMBER token: 42 is i32, 42L is i64, 4.2 is f64.
+ */
+inline Exp toNumber(std::string_view token) {
+  if (token.back() == 'L') {
+    return Exp(parseNumber<int64_t>(token.substr(0, token.size() - 1)));
+  }
+  if (token.find('.') != std::string_view::npos) {
+    return Exp(parseNumber<double>(token));
+  }
+  return Exp(parseNumber<int>(token));
+}
+
+/**
+ * Bump arena owning the AST: the parsed sources and all the nodes.
+ *
+ * Elements of the list being parsed are collected on a pending stack, and
+ * moved into the arena as one contiguous span when the list is closed, so
+ * no subtree is ever copied after it's built. Nodes stay valid for the
+ * lifetime of the arena.
+ */
+class ExpArena {
+ public:
+  /**
+   * Takes ownership of a source buffer, atoms will point into it.
+   */
+  std::string_view addSource(std::string source) {
+    sources_.push_back(std::make_unique<std::string>(std::move(source)));
+    return *sources_.back();
+  }
+
+  void openList() { listStarts_.push_back(pending_.size()); }
+
+  void addToList(const Exp& exp) { pending_.push_back(exp); }
+
+  Exp closeList() {
+    auto start = listStarts_.back();
+    listStarts_.pop_back();
+
+    auto count = pending_.size() - start;
+    auto items = allocate(count);
+    std::copy(pending_.begin() + start, pending_.end(), items);
+    pending_.resize(start);
+
+    return Exp(ExpList{items, static_cast<uint32_t>(count)});
+  }
+
+  /**
+   * Number of nodes allocated in the arena.
+   */
+  size_t size() const { return allocated_; }
+
+ private:
+  static constexpr size_t CHUNK_SIZE = 16 * 1024;
+
+  Exp* allocate(size_t count) {
+    if (count == 0) {
+      return nullptr;
+    }
+    if (chunks_.empty() || chunkUsed_ + count > chunkCapacity_) {
+      chunkCapacity_ = std::max(CHUNK_SIZE, count);
+      chunks_.push_back(std::make_unique<Exp[]>(chunkCapacity_));
+      chunkUsed_ = 0;
     }
+    auto items = chunks_.back().get() + chunkUsed_;
+    chunkUsed_ += count;
+    allocated_ += count;
+    return items;
   }
 
-  // Lists:
-  Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
+  std::vector<std::unique_ptr<std::string>> sources_;
+  std::vector<std::unique_ptr<Exp[]>> chunks_;
+  size_t chunkUsed_ = 0;
+  size_t chunkCapacity_ = 0;
+  size_t allocated_ = 0;
 
+  std::vector<Exp> pending_;
+  std::vector<size_t> listStarts_;
 };
 
 using Value = Exp;  // clang-format on
@@ -101,14 +351,29 @@ namespace syntax {
  */
 // clang-format off
 /**
- * Generic tokenizer used by the parser in the Syntax tool.
+ * Hand-written tokenizer for the Eva lexical grammar.
  *
- * https://www.npmjs.com/package/syntax-cli
+ * Replaces the regex-driven tokenizer generated by the Syntax tool: the
+ * input is scanned in place (no per-token substrings, no regex matching),
+ * and tokens are returned as views into the original buffer. The rules
+ * mirror the `%lex` section of EvaGrammar.bnf and are tried in the same
+ * order, so the first rule that matches wins:
+ *
+ *   \/\/.*             %empty
+ *   \/\*[\s\S]*?\*\/   %empty
+ *   \s+                %empty
+ *   \"[^\"]*\"         STRING
+ *   \d+(\.\d+|L)?      NUMBER
+ *   [\w\-+*=!<>/]+     SYMBOL
+ *
+ * Keep it in sync with the grammar file when the lexical rules change.
  */
 
 #ifndef __Syntax_Tokenizer_h
 #define __Syntax_Tokenizer_h
 
+#include <string_view>
+
 class Tokenizer;
 
 // ------------------------------------------------------------------
@@ -131,7 +396,7 @@ enum class TokenType {
 
 struct Token {
   TokenType type;
-  std::string value;
+  std::string_view value;
 
   int startOffset;
   int endOffset;
@@ -141,26 +406,42 @@ struct Token {
   int endColumn;
 };
 
-using SharedToken = std::shared_ptr<Token>;
-
-typedef TokenType (*LexRuleHandler)(const Tokenizer&, const std::string&);
-
 // ------------------------------------------------------------------
-// Lex rule: [regex, handler]
+// Character classes.
 
-struct LexRule {
-  std::regex regex;
-  LexRuleHandler handler;
+namespace lex {
+
+enum CharClass : unsigned char {
+  CC_SPACE = 1 << 0,   // \s
+  CC_DIGIT = 1 << 1,   // \d
+  CC_SYMBOL = 1 << 2,  // [\w\-+*=!<>/]
 };
 
-// ------------------------------------------------------------------
-// Token.
+constexpr std::array<unsigned char, 256> makeCharClasses() {
+  std::array<unsigned char, 256> table{};
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+    table[c] |= CC_SPACE;
+  }
+  for (int c = '0'; c <= '9'; c++) {
+    table[c] |= CC_DIGIT | CC_SYMBOL;
+  }
+  for (int c = 'a'; c <= 'z'; c++) {
+    table[c] |= CC_SYMBOL;
+    table[c - 'a' + 'A'] |= CC_SYMBOL;
+  }
+  for (unsigned char c : {'_', '-', '+', '*', '=', '!', '<', '>', '/'}) {
+    table[c] |= CC_SYMBOL;
+  }
+  return table;
+}
 
-enum TokenizerState {
-  // clang-format off
-  INITIAL
-  // clang-format on
-};
+inline constexpr std::array<unsigned char, 256> charClasses = makeCharClasses();
+
+inline bool is(char c, CharClass cc) {
+  return charClasses[static_cast<unsigned char>(c)] & cc;
+}
+
+}  // namespace lex
 
 // ------------------------------------------------------------------
 // Tokenizer.
@@ -168,15 +449,12 @@ enum TokenizerState {
 class Tokenizer {
  public:
   /**
-   * Initializes a parsing string.
+   * Initializes a parsing string. The string is not copied, it must
+   * outlive the tokenizer (or the next `initString` call).
    */
-  void initString(const std::string& str) {
+  void initString(std::string_view str) {
     str_ = str;
 
-    // Initialize states.
-    states_.clear();
-    states_.push_back(TokenizerState::INITIAL);
-
     cursor_ = 0;
     currentLine_ = 1;
     currentColumn_ = 0;
@@ -195,77 +473,31 @@ class Tokenizer {
    */
   inline bool hasMoreTokens() { return cursor_ <= str_.length(); }
 
-  /**
-   * Returns current tokenizing state.
-   */
-  TokenizerState getCurrentState() { return states_.back(); }
-
-  /**
-   * Enters a new state pushing it on the states stack.
-   */
-  void pushState(TokenizerState state) { states_.push_back(state); }
-
-  /**
-   * Alias for `push_state`.
-   */
-  void begin(TokenizerState state) { states_.push_back(state); }
-
-  /**
-   * Exits a current state popping it from the states stack.
-   */
-  TokenizerState popState() {
-    auto state = states_.back();
-    states_.pop_back();
-    return state;
-  }
-
   /**
    * Returns next token.
    */
-  SharedToken getNextToken() {
-    if (!hasMoreTokens()) {
-      yytext = __EOF;
-      return toToken(TokenType::__EOF);
-    }
-
-    auto strSlice = str_.substr(cursor_);
-
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
-
-    for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
-      std::smatch sm;
-
-      if (std::regex_search(strSlice, sm, rule.regex)) {
-        yytext = sm[0];
-
-        captureLocations_(yytext);
-        cursor_ += yytext.length();
+  Token getNextToken() {
+    for (;;) {
+      if (!hasMoreTokens()) {
+        yytext = __EOF;
+        return toToken(TokenType::__EOF);
+      }
 
-        // Manual handling of EOF token (the end of string). Return it
-        // as `EOF` symbol.
-        if (yytext.length() == 0) {
-          cursor_++;
-        }
+      if (isEOF()) {
+        cursor_++;
+        yytext = __EOF;
+        return toToken(TokenType::__EOF);
+      }
 
-        auto tokenType = rule.handler(*this, yytext);
+      auto tokenType = scan_();
 
-        if (tokenType == TokenType::__EMPTY) {
-          return getNextToken();
-        }
+      captureLocations_(yytext);
+      cursor_ += yytext.length();
 
+      if (tokenType != TokenType::__EMPTY) {
         return toToken(tokenType);
       }
     }
-
-    if (isEOF()) {
-      cursor_++;
-      yytext = __EOF;
-      return toToken(TokenType::__EOF);
-    }
-
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
-                         currentColumn_);
   }
 
   /**
@@ -273,8 +505,8 @@ class Tokenizer {
    */
   inline bool isEOF() { return cursor_ == str_.length(); }
 
-  SharedToken toToken(TokenType tokenType) {
-    return std::shared_ptr<Token>(new Token{
+  Token toToken(TokenType tokenType) {
+    return Token{
         .type = tokenType,
         .value = yytext,
         .startOffset = tokenStartOffset_,
@@ -283,7 +515,7 @@ class Tokenizer {
         .endLine = tokenEndLine_,
         .startColumn = tokenStartColumn_,
         .endColumn = tokenEndColumn_,
-    });
+    };
   }
 
   /**
@@ -291,15 +523,16 @@ class Tokenizer {
    * line from the source, pointing with the ^ marker to the bad token.
    * In addition, shows `line:column` location.
    */
-  [[noreturn]] void throwUnexpectedToken(const std::string& symbol, int line,
+  [[noreturn]] void throwUnexpectedToken(std::string_view symbol, int line,
                                          int column) {
-    std::stringstream ss{str_};
-    std::string lineStr;
-    int currentLine = 1;
-
-    while (currentLine++ <= line) {
-      std::getline(ss, lineStr, '\n');
+    std::string_view lineStr = str_;
+    for (int currentLine = 1; currentLine < line; currentLine++) {
+      auto newLine = lineStr.find('\n');
+      lineStr = newLine == std::string_view::npos
+                    ? std::string_view{}
+                    : lineStr.substr(newLine + 1);
     }
+    lineStr = lineStr.substr(0, lineStr.find('\n'));
 
     auto pad = std::string(column, ' ');
 
@@ -317,13 +550,99 @@ class Tokenizer {
   /**
    * Matched text.
    */
-  std::string yytext;
+  std::string_view yytext;
 
  private:
+  /**
+   * Matches the longest token of the first applicable rule at the cursor,
+   * sets `yytext` and returns its type (`__EMPTY` for skipped input).
+   */
+  TokenType scan_() {
+    const char* begin = str_.data() + cursor_;
+    const char* end = str_.data() + str_.length();
+    const char* p = begin;
+    auto type = TokenType::__EMPTY;
+
+    auto match = [&](TokenType matchedType) {
+      yytext = std::string_view(begin, p - begin);
+      return matchedType;
+    };
+
+    switch (*p) {
+      case '(':
+        p++;
+        return match(TokenType::TOKEN_TYPE_7);
+
+      case ')':
+        p++;
+        return match(TokenType::TOKEN_TYPE_8);
+
+      case '/':
+        // \/\/.* -- `.` does not match line terminators.
+        if (p + 1 < end && p[1] == '/') {
+          p += 2;
+          while (p < end && *p != '\n' && *p != '\r') {
+            p++;
+          }
+          return match(TokenType::__EMPTY);
+        }
+        // \/\*[\s\S]*?\*\/ -- unterminated comments fall through to SYMBOL.
+        if (p + 1 < end && p[1] == '*') {
+          auto close = std::string_view(p + 2, end - p - 2).find("*/");
+          if (close != std::string_view::npos) {
+            p += 2 + close + 2;
+            return match(TokenType::__EMPTY);
+          }
+        }
+        break;
+
+      case '"': {
+        // \"[^\"]*\" -- unterminated strings are not tokens.
+        auto close = std::string_view(p + 1, end - p - 1).find('"');
+        if (close != std::string_view::npos) {
+          p += 1 + close + 1;
+          return match(TokenType::STRING);
+        }
+        throwUnexpectedToken("\"", currentLine_, currentColumn_);
+      }
+    }
+
+    if (lex::is(*p, lex::CC_SPACE)) {
+      type = TokenType::__EMPTY;
+      while (p < end && lex::is(*p, lex::CC_SPACE)) {
+        p++;
+      }
+    } else if (lex::is(*p, lex::CC_DIGIT)) {
+      type = TokenType::NUMBER;
+      while (p < end && lex::is(*p, lex::CC_DIGIT)) {
+        p++;
+      }
+      // (\.\d+|L)?
+      if (p + 1 < end && *p == '.' && lex::is(p[1], lex::CC_DIGIT)) {
+        p++;
+        while (p < end && lex::is(*p, lex::CC_DIGIT)) {
+          p++;
+        }
+      } else if (p < end && *p == 'L') {
+        p++;
+      }
+    } else if (lex::is(*p, lex::CC_SYMBOL)) {
+      type = TokenType::SYMBOL;
+      while (p < end && lex::is(*p, lex::CC_SYMBOL)) {
+        p++;
+      }
+    } else {
+      throwUnexpectedToken(std::string_view(p, 1), currentLine_,
+                           currentColumn_);
+    }
+
+    return match(type);
+  }
+
   /**
    * Captures token locations.
    */
-  void captureLocations_(const std::string& matched) {
+  void captureLocations_(std::string_view matched) {
     auto len = matched.length();
 
     // Absolute offsets.
@@ -334,13 +653,10 @@ class Tokenizer {
     tokenStartColumn_ = tokenStartOffset_ - currentLineBeginOffset_;
 
     // Extract `\n` in the matched token.
-    std::stringstream ss{matched};
-    std::string lineStr;
-    std::getline(ss, lineStr, '\n');
-    while (ss.tellg() > 0 && ss.tellg() <= len) {
+    for (auto pos = matched.find('\n'); pos != std::string_view::npos;
+         pos = matched.find('\n', pos + 1)) {
       currentLine_++;
-      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
-      std::getline(ss, lineStr, '\n');
+      currentLineBeginOffset_ = tokenStartOffset_ + pos + 1;
     }
 
     tokenEndOffset_ = cursor_ + len;
@@ -351,34 +667,20 @@ class Tokenizer {
     currentColumn_ = tokenEndColumn_;
   }
 
-  /**
-   * Lexical rules.
-   */
-  // clang-format off
-  static constexpr size_t LEX_RULES_COUNT = 8;
-  static std::array<LexRule, LEX_RULES_COUNT> lexRules_;
-  static std::map<TokenizerState, std::vector<size_t>> lexRulesByStartConditions_;
-  // clang-format on
-
   /**
    * Special EOF token.
    */
-  static std::string __EOF;
+  static constexpr std::string_view __EOF = "$";
 
   /**
    * Tokenizing string.
    */
-  std::string str_;
+  std::string_view str_;
 
   /**
    * Cursor for current symbol.
    */
-  int cursor_;
-
-  /**
-   * States.
-   */
-  std::vector<TokenizerState> states_;
+  size_t cursor_;
 
   /**
    * Line-based location tracking.
@@ -398,62 +700,6 @@ class Tokenizer {
   int tokenEndColumn_;
 };
 
-// ------------------------------------------------------------------
-// Lexical rule handlers.
-
-std::string Tokenizer::__EOF("$");
-
-// clang-format off
-inline TokenType _lexRule1(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::TOKEN_TYPE_7;
-}
-
-inline TokenType _lexRule2(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::TOKEN_TYPE_8;
-}
-
-inline TokenType _lexRule3(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule4(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule5(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::__EMPTY;
-}
-
-inline TokenType _lexRule6(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::STRING;
-}
-
-inline TokenType _lexRule7(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::NUMBER;
-}
-
-inline TokenType _lexRule8(const Tokenizer& tokenizer, const std::string& yytext) {
-return TokenType::SYMBOL;
-}
-// clang-format on
-
-// ------------------------------------------------------------------
-// Lexical rules.
-
-// clang-format off
-std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
-  {std::regex(R"(^\()"), &_lexRule1},
-  {std::regex(R"(^\))"), &_lexRule2},
-  {std::regex(R"(^\/\/.*)"), &_lexRule3},
-  {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
-  {std::regex(R"(^\s+)"), &_lexRule5},
-  {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
-  {std::regex(R"(^[\w\-+*=!<>/]+)"), &_lexRule8}
-}};
-std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
-// clang-format on
-
 #endif
 // clang-format on
 
@@ -472,6 +718,7 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
  * Parsing table type.
  */
 enum class TE {
+  Error,
   Accept,
   Shift,
   Reduce,
@@ -506,9 +753,6 @@ struct Production {
   ProductionHandler handler;
 };
 
-// Key: Encoded symbol (terminal or non-terminal) index
-// Value: TableEntry
-using Row = std::map<int, TableEntry>;
 
 /**
  * Parser class.
@@ -525,7 +769,7 @@ class EvaParser {
   /**
    * Token values stack.
    */
-  std::vector<std::string> tokensStack;
+  std::vector<std::string_view> tokensStack;
 
   /**
    * Parsing states stack.
@@ -537,21 +781,32 @@ class EvaParser {
    */
   Tokenizer tokenizer;
 
+  /**
+   * AST storage, parsed sources and nodes live as long as the parser.
+   */
+  ExpArena arena;
+
+  /**
+   * Interned symbols of all the parsed sources.
+   */
+  SymbolTable symbols;
+
   /**
    * Previous state to calculate the next one.
    */
   int previousState;
 
   /**
-   * Parses a string.
+   * Parses a string. The string is moved into the arena, the returned AST
+   * points into it.
    */
-  Value parse(const std::string& str) {
+  Value parse(std::string str) {
     // clang-format off
 
     // clang-format on
 
     // Initialize the tokenizer and the string.
-    tokenizer.initString(str);
+    tokenizer.initString(arena.addSource(std::move(str)));
 
     // Initialize the stacks.
     valuesStack.clear();
@@ -567,18 +822,18 @@ class EvaParser {
     // Main parsing loop.
     for (;;) {
       auto state = statesStack.back();
-      auto column = (int)token->type;
+      auto column = (int)token.type;
+
+      const auto& entry = table_[state][column];
 
-      if (table_[state].count(column) == 0) {
+      if (entry.type == TE::Error) {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
-
       // Shift a token, go to state.
       if (entry.type == TE::Shift) {
         // Push token.
-        tokensStack.push_back(token->value);
+        tokensStack.push_back(token.value);
 
         // Push next state number: "s5" -> 5
         statesStack.push_back(entry.value);
@@ -590,9 +845,9 @@ class EvaParser {
       // Reduce by production.
       else if (entry.type == TE::Reduce) {
         auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
+        const auto& production = productions_[productionNumber];
 
-        tokenizer.yytext = shiftedToken->value;
+        tokenizer.yytext = shiftedToken.value;
 
         auto rhsLength = production.rhsLength;
         while (rhsLength > 0) {
@@ -606,7 +861,8 @@ class EvaParser {
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+        const auto& nextStateEntry =
+            table_[previousState][symbolToReduceWith];
         assert(nextStateEntry.type == TE::Transit);
 
         statesStack.push_back(nextStateEntry.value);
@@ -642,22 +898,34 @@ class EvaParser {
   /**
    * Throws parser error on unexpected token.
    */
-  [[noreturn]] void throwUnexpectedToken(SharedToken token) {
-    if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
+  [[noreturn]] void throwUnexpectedToken(const Token& token) {
+    if (token.type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
       std::string errMsg = "Unexpected end of input.\n";
       std::cerr << errMsg;
       throw std::runtime_error(errMsg.c_str());
     }
-    tokenizer.throwUnexpectedToken(token->value, token->startLine,
-                                   token->startColumn);
+    tokenizer.throwUnexpectedToken(token.value, token.startLine,
+                                   token.startColumn);
+  }
+
+  /**
+   * Parsing table entries shorthands.
+   */
+  static constexpr TableEntry err{TE::Error, 0};
+  static constexpr TableEntry acc{TE::Accept, 0};
+  static constexpr TableEntry s(int state) { return {TE::Shift, state}; }
+  static constexpr TableEntry r(int production) {
+    return {TE::Reduce, production};
   }
+  static constexpr TableEntry t(int state) { return {TE::Transit, state}; }
 
   // clang-format off
   static constexpr size_t PRODUCTIONS_COUNT = 9;
-  static std::array<Production, PRODUCTIONS_COUNT> productions_;
+  static const Production productions_[PRODUCTIONS_COUNT];
 
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static constexpr size_t COLUMNS_COUNT = 10;
+  static const TableEntry table_[ROWS_COUNT][COLUMNS_COUNT];
   // clang-format on
 };
 
@@ -702,7 +970,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = toNumber(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -724,7 +992,7 @@ void _handler6(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1, parser.symbols.intern(_1)) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -737,7 +1005,7 @@ parser.tokensStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
 
-auto __ = _2 ;
+auto __ = parser.arena.closeList() ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -748,7 +1016,7 @@ void _handler8(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+parser.arena.openList(); auto __ = Exp() ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -760,7 +1028,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+parser.arena.addToList(_2); auto __ = _1 ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -769,33 +1037,40 @@ PUSH_VR();
 // clang-format on
 
 // clang-format off
-std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
-{0, 1, &_handler2},
-{0, 1, &_handler3},
-{1, 1, &_handler4},
-{1, 1, &_handler5},
-{1, 1, &_handler6},
-{2, 3, &_handler7},
-{3, 0, &_handler8},
-{3, 2, &_handler9}}};
+constexpr Production yyparse::productions_[yyparse::PRODUCTIONS_COUNT] = {
+  {-1, 1, &_handler1},
+  {0, 1, &_handler2},
+  {0, 1, &_handler3},
+  {1, 1, &_handler4},
+  {1, 1, &_handler5},
+  {1, 1, &_handler6},
+  {2, 3, &_handler7},
+  {3, 0, &_handler8},
+  {3, 2, &_handler9},
+};
 // clang-format on
 
 // ------------------------------------------------------------------
 // Parsing table.
 
 // clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
+//
+// Columns: encoded symbols (terminals and non-terminals):
+//
+//   Exp  Atom  List  ListEntries  NUMBER  STRING  SYMBOL  '('  ')'  $
+//
+constexpr TableEntry yyparse::table_[yyparse::ROWS_COUNT][yyparse::COLUMNS_COUNT] = {
+  { t(1),  t(2),  t(3),   err,  s(4),  s(5),  s(6),  s(7),   err,   err},
+  {  err,   err,   err,   err,   err,   err,   err,   err,   err,   acc},
+  {  err,   err,   err,   err,  r(1),  r(1),  r(1),  r(1),  r(1),  r(1)},
+  {  err,   err,   err,   err,  r(2),  r(2),  r(2),  r(2),  r(2),  r(2)},
+  {  err,   err,   err,   err,  r(3),  r(3),  r(3),  r(3),  r(3),  r(3)},
+  {  err,   err,   err,   err,  r(4),  r(4),  r(4),  r(4),  r(4),  r(4)},
+  {  err,   err,   err,   err,  r(5),  r(5),  r(5),  r(5),  r(5),  r(5)},
+  {  err,   err,   err,  t(8),  r(7),  r(7),  r(7),  r(7),  r(7),   err},
+  {t(10),  t(2),  t(3),   err,  s(4),  s(5),  s(6),  s(7),  s(9),   err},
+  {  err,   err,   err,   err,  r(6),  r(6),  r(6),  r(6),  r(6),  r(6)},
+  {  err,   err,   err,   err,  r(8),  r(8),  r(8),  r(8),  r(8),   err},
 };
 // clang-format on
 
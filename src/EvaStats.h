@@ -0,0 +1,163 @@
+#ifndef EvaStats_h
+#define EvaStats_h
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+/**
+ * Compiler statistics: the time of the phases and the size of the program.
+ * They're printed as a table or as JSON for the compile time tracking.
+ */
+class EvaStats {
+  public:
+    /**
+     * Time of a phase, the repeated runs accumulate
+     */
+    struct Phase {
+        std::string name;
+        double      wallMs = 0;
+        double      cpuMs = 0;
+    };
+
+    /**
+     * Time the scope as a phase, it does nothing without the stats
+     */
+    class Timer {
+      public:
+        Timer(EvaStats* stats, const char* name) : stats_(stats), name_(name) {
+            if (stats_ != nullptr) {
+                wallStart_ = std::chrono::steady_clock::now();
+                cpuStart_ = std::clock();
+            }
+        }
+
+        ~Timer() {
+            if (stats_ == nullptr) {
+                return;
+            }
+            auto& phase = stats_->getPhase(name_);
+            phase.wallMs += std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - wallStart_)
+                                .count();
+            phase.cpuMs += 1000.0 * (std::clock() - cpuStart_) / CLOCKS_PER_SEC;
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+      private:
+        EvaStats*                             stats_;
+        const char*                           name_;
+        std::chrono::steady_clock::time_point wallStart_;
+        std::clock_t                          cpuStart_ = 0;
+    };
+
+    /**
+     * Get a phase by name, the new ones are added in the order of the runs
+     */
+    Phase& getPhase(const std::string& name) {
+        for (auto& phase : phases) {
+            if (phase.name == name) {
+                return phase;
+            }
+        }
+        phases.push_back({name});
+        return phases.back();
+    }
+
+    /**
+     * Peak resident set size of the process
+     */
+    static uint64_t getPeakRssKb() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    /**
+     * Print the table of the phases and the counters
+     */
+    void print(FILE* out) const {
+        fprintf(out, "===== Eva compile report =====\n");
+        fprintf(out, "%-12s %12s %12s\n", "phase", "wall(ms)", "cpu(ms)");
+        double wallTotal = 0;
+        double cpuTotal = 0;
+        for (const auto& phase : phases) {
+            fprintf(
+                out,
+                "%-12s %12.3f %12.3f\n",
+                phase.name.c_str(),
+                phase.wallMs,
+                phase.cpuMs);
+            wallTotal += phase.wallMs;
+            cpuTotal += phase.cpuMs;
+        }
+        fprintf(out, "%-12s %12.3f %12.3f\n", "total", wallTotal, cpuTotal);
+        fprintf(out, "\n");
+        for (const auto& [name, value] : getCounters()) {
+            fprintf(out, "%-12s %12llu\n", name, (unsigned long long)value);
+        }
+    }
+
+    /**
+     * Print as a JSON object
+     */
+    void printJSON(FILE* out) const {
+        fprintf(out, "{\n  \"phases\": {");
+        const char* sep = "";
+        for (const auto& phase : phases) {
+            fprintf(
+                out,
+                "%s\n    \"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+                sep,
+                phase.name.c_str(),
+                phase.wallMs,
+                phase.cpuMs);
+            sep = ",";
+        }
+        fprintf(out, "\n  },\n  \"counters\": {");
+        sep = "";
+        for (const auto& [name, value] : getCounters()) {
+            fprintf(
+                out,
+                "%s\n    \"%s\": %llu",
+                sep,
+                name,
+                (unsigned long long)value);
+            sep = ",";
+        }
+        fprintf(out, "\n  }\n}\n");
+    }
+
+    std::vector<Phase> phases;
+
+    uint64_t tokens = 0;
+    uint64_t astNodes = 0;
+    uint64_t functions = 0;
+    uint64_t classes = 0;
+    uint64_t instructions = 0;
+    uint64_t envLookups = 0;
+    uint64_t constEvals = 0;
+
+  private:
+    std::vector<std::pair<const char*, uint64_t>> getCounters() const {
+        return {
+            {"tokens", tokens},
+            {"ast_nodes", astNodes},
+            {"functions", functions},
+            {"classes", classes},
+            {"instructions", instructions},
+            {"env_lookups", envLookups},
+            {"const_evals", constEvals},
+            {"peak_rss_kb", getPeakRssKb()},
+        };
+    }
+};
+
+#endif // EvaStats_h
@@ -0,0 +1,129 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Tracing of the compiler internals, it's enabled at run time with the
+ * EVA_DEBUG env var: a comma separated list of categories, e.g.
+ * EVA_DEBUG=var,class, any other value enables all of them.
+ *
+ * The arguments of a trace point are only evaluated when its category is
+ * enabled. EVA_TRACE_ENABLED=0 removes the trace points entirely, cmake
+ * defines it when the EVA_NO_TRACE env var is set at configure time.
+ */
+
+#ifndef EVA_TRACE_ENABLED
+#define EVA_TRACE_ENABLED 1
+#endif
+
+/**
+ * Trace categories, bit flags of the mask
+ */
+enum TraceCategory : uint32_t {
+    TRACE_GEN = 1 << 0,   // expressions being generated and their results
+    TRACE_VAR = 1 << 1,   // variables declaration and lookup
+    TRACE_FUNC = 1 << 2,  // functions definition and calls
+    TRACE_CLASS = 1 << 3, // classes, fields, methods and instances
+    TRACE_ENV = 1 << 4,   // environment bindings
+    TRACE_CONST = 1 << 5, // expressions evaluated at compile time
+    TRACE_ALL = ~0u,
+};
+
+/**
+ * Parse the categories mask from EVA_DEBUG
+ */
+inline uint32_t parseTraceMask(const char* spec) {
+    if (spec == nullptr) {
+        return 0;
+    }
+    static const struct {
+        const char* name;
+        uint32_t    category;
+    } names[] = {
+        {"gen", TRACE_GEN},
+        {"var", TRACE_VAR},
+        {"func", TRACE_FUNC},
+        {"class", TRACE_CLASS},
+        {"env", TRACE_ENV},
+        {"const", TRACE_CONST},
+    };
+    uint32_t mask = 0;
+    for (const char* p = spec; *p;) {
+        const size_t len = std::strcspn(p, ",");
+        bool         found = false;
+        for (const auto& n : names) {
+            if (std::strlen(n.name) == len && !std::strncmp(p, n.name, len)) {
+                mask |= n.category;
+                found = true;
+            }
+        }
+        // e.g. EVA_DEBUG=1
+        if (!found) {
+            return TRACE_ALL;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return mask == 0 ? TRACE_ALL : mask;
+}
+
+/**
+ * Enabled categories
+ */
+inline const uint32_t traceMask = parseTraceMask(std::getenv("EVA_DEBUG"));
+
+inline bool traceEnabled(uint32_t category) {
+    return (traceMask & category) != 0;
+}
+
+/**
+ * Print a trace message, the category is checked by EVA_TRACE
+ */
+__attribute__((format(printf, 1, 2))) inline void
+tracef(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+#if EVA_TRACE_ENABLED
+#define EVA_TRACE(category, ...)                                               \
+    do {                                                                       \
+        if (traceEnabled(category)) {                                          \
+            tracef(__VA_ARGS__);                                               \
+        }                                                                      \
+    } while (0)
+#else
+#define EVA_TRACE(category, ...)                                               \
+    do {                                                                       \
+    } while (0)
+#endif
+
+/**
+ * Nesting level of the trace messages until the end of the scope, also when
+ * it's left by an exception
+ */
+struct TraceScope {
+    explicit TraceScope(unsigned& depth) : depth(depth) { depth++; }
+    ~TraceScope() { depth--; }
+
+    unsigned& depth;
+};
+
+#if EVA_TRACE_ENABLED
+#define EVA_TRACE_SCOPE(depth) TraceScope traceScope_(depth)
+#else
+#define EVA_TRACE_SCOPE(depth)                                                 \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#endif // Trace_h
@@ -0,0 +1,76 @@
+/**
+ * Tokenizer benchmark
+ *
+ * Tokenizes generated Eva programs of growing size and prints the
+ * throughput for each size. The time per byte should stay flat as the
+ * input grows, i.e. tokenizing scales linearly with the input size.
+ *
+ * Usage: eva-tokenizer-bench [max_size_mb]   (default: 100)
+ */
+#include "EvaParser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/**
+ * A chunk of Eva code covering every token class.
+ */
+static const std::string chunk = R"(
+// square of a number
+(def square (x) (* x x))
+/* typed
+   function */
+(def sum ((a number) (b number)) -> number (+ a b))
+(var x 42)
+(while (< x 100) (begin (printf "x = %d\n" x) (set x (+ x 1))))
+)";
+
+/**
+ * Generate a program of at least `size` bytes
+ */
+static std::string generateProgram(size_t size) {
+    std::string program;
+    program.reserve(size + chunk.size());
+    while (program.size() < size) {
+        program += chunk;
+    }
+    return program;
+}
+
+int main(int argc, char* argv[]) {
+    size_t maxSizeMb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+
+    printf(
+        "%10s %12s %10s %10s %10s\n",
+        "size(MB)",
+        "tokens",
+        "time(ms)",
+        "MB/s",
+        "ns/byte");
+
+    for (size_t sizeMb = 1; sizeMb <= maxSizeMb; sizeMb *= 10) {
+        const auto program = generateProgram(sizeMb << 20);
+
+        syntax::Tokenizer tokenizer;
+        tokenizer.initString(program);
+
+        size_t tokens = 0;
+        auto   start = std::chrono::steady_clock::now();
+        while (tokenizer.getNextToken().type != syntax::TokenType::__EOF) {
+            tokens++;
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        printf(
+            "%10zu %12zu %10.1f %10.1f %10.2f\n",
+            sizeMb,
+            tokens,
+            seconds * 1e3,
+            program.size() / seconds / (1 << 20),
+            seconds * 1e9 / program.size());
+    }
+    return 0;
+}
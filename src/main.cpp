@@ -1,8 +1,10 @@
 #include "EvaLLVM.h"
 
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 std::string read_file(const std::string& filename) {
     std::ifstream t(filename);
@@ -27,37 +29,210 @@ std::string read_stdin() {
     return file_contents;
 }
 
+/**
+ * Count the unbalanced parentheses, strings and comments are skipped
+ */
+int paren_depth(const std::string& str) {
+    int depth = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '"') {
+            i = str.find('"', i + 1);
+            if (i == std::string::npos) {
+                break;
+            }
+        }
+        else if (str.compare(i, 2, "//") == 0) {
+            i = str.find('\n', i);
+            if (i == std::string::npos) {
+                break;
+            }
+        }
+        else if (str[i] == '(') {
+            depth++;
+        }
+        else if (str[i] == ')') {
+            depth--;
+        }
+    }
+    return depth;
+}
+
+/**
+ * Read-eval-print loop: every complete input is compiled and run right away,
+ * the definitions are kept for the next inputs.
+ */
+int run_repl(EvaLLVM& vm) {
+    printf("Eva REPL, Ctrl-D to exit\n");
+    std::string line;
+    std::string input;
+    for (;;) {
+        printf(input.empty() ? "eva> " : "...> ");
+        fflush(stdout);
+        if (!std::getline(std::cin, line)) {
+            break;
+        }
+        // skip the blank and the comment lines between the inputs
+        const auto start = line.find_first_not_of(" \t\r");
+        if (input.empty() &&
+            (start == std::string::npos || line.compare(start, 2, "//") == 0)) {
+            continue;
+        }
+        input += line + "\n";
+        if (paren_depth(input) > 0) {
+            continue;
+        }
+        try {
+            vm.evalIncremental(input);
+        }
+        catch (const std::exception& e) {
+            printf("Error: %s\n", e.what());
+        }
+        fflush(stdout);
+        input.clear();
+    }
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Parse the number of partitions of -j{jobs}, 0 is one partition
+ */
+bool parse_jobs(const std::string& value, unsigned& jobs) {
+    static constexpr unsigned maxJobs = 256;
+    // the digits are bounded first, std::stoul throws on an overflow
+    if (value.empty() || value.size() > 3 ||
+        value.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    const auto parsed = std::stoul(value);
+    if (parsed > maxJobs) {
+        return false;
+    }
+    jobs = std::max(1ul, parsed);
+    return true;
+}
+
 int main(int argc, char *argv[]) {
 
     /**
      * Parameters check.
      */
-    if (argc != 1 && argc != 3) {
-        printf("Usage: %s [{input_filename} {output_filename}]\n", argv[0]);
+    EvaOptions options;
+    if (const auto cacheDir = std::getenv("EVA_CACHE_DIR")) {
+        options.cacheDir = cacheDir;
+    }
+    // the statistics for the dashboards, a JSON file or "-" for stderr
+    if (const auto statsFile = std::getenv("EVA_STATS")) {
+        options.stats = StatsFormat::JSON;
+        if (std::string(statsFile) != "-") {
+            options.statsFile = statsFile;
+        }
+    }
+    std::vector<std::string> files;
+    bool run = false;
+    bool repl = false;
+    bool badArg = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3") {
+            options.optLevel = arg[2] - '0';
+        }
+        else if (arg == "--emit=ll") {
+            options.output = OutputKind::IR;
+        }
+        else if (arg == "--emit=bc") {
+            options.output = OutputKind::Bitcode;
+        }
+        else if (arg == "--emit=obj") {
+            options.output = OutputKind::Object;
+        }
+        else if (arg == "--emit=exe") {
+            options.output = OutputKind::Executable;
+        }
+        else if (arg == "--module-summary") {
+            options.moduleSummary = true;
+        }
+        else if (arg == "--fast-math") {
+            options.fastMath = true;
+        }
+        else if (arg == "--run") {
+            run = true;
+        }
+        else if (arg == "--run=lazy") {
+            run = true;
+            options.lazyJIT = true;
+        }
+        else if (arg == "--repl") {
+            repl = true;
+        }
+        else if (arg == "--time-report") {
+            options.stats = StatsFormat::Text;
+        }
+        else if (arg == "--time-report=json") {
+            options.stats = StatsFormat::JSON;
+        }
+        else if (arg.size() > 2 && arg.compare(0, 2, "-j") == 0) {
+            if (!parse_jobs(arg.substr(2), options.jobs)) {
+                badArg = true;
+            }
+        }
+        else if (arg[0] == '-') {
+            badArg = true;
+        }
+        else {
+            files.push_back(arg);
+        }
+    }
+    const size_t fileCount = run ? 1 : 2;
+    if (badArg || (files.size() != 0 && files.size() != fileCount) ||
+        (repl && !files.empty())) {
+        printf("Usage: %s [-O0|-O1|-O2|-O3] [--fast-math] [-j{jobs}] [--emit=ll|bc|obj|exe] [--module-summary] [--time-report[=json]] [{input_filename} {output_filename}]\n", argv[0]);
+        printf("       %s [-O0|-O1|-O2|-O3] [--fast-math] [--time-report[=json]] --run[=lazy] [{input_filename}]\n", argv[0]);
+        printf("       %s [-O0|-O1|-O2|-O3] [--fast-math] --repl\n", argv[0]);
         return 1;
     }
 
+    /**
+     * Interactive mode.
+     */
+    if (repl) {
+        EvaLLVM vm(options);
+        return run_repl(vm);
+    }
+
     /**
      * The program to be executed.
      */
     std::string input_data_str;
     std::string output_filename = "output.ll";
-    if (argc == 3) {
-        input_data_str = read_file(argv[1]);
-        output_filename = argv[2];
+    if (files.empty()) {
+        input_data_str = read_stdin();
     }
     else {
-        input_data_str = read_stdin();
+        input_data_str = read_file(files[0]);
+        if (files.size() == 2) {
+            output_filename = files[1];
+        }
     }
 
     /**
      * Compiler instance.
      */
-    EvaLLVM vm;
+    EvaLLVM vm(options);
+
+    /**
+     * Execute in-process with the JIT.
+     */
+    if (run) {
+        const auto exitCode = vm.run(input_data_str);
+        vm.printStats();
+        return exitCode;
+    }
 
     /**
      * Generate LLVM IR.
      */
     vm.eval(input_data_str, output_filename);
+    vm.printStats();
     return 0;
 }
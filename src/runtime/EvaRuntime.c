@@ -0,0 +1,156 @@
+#include "EvaRuntime.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * libgc, the arena chunks are scanned for pointers to the GC heap but they
+ * are never collected, they're freed explicitly
+ */
+#ifdef EVA_RUNTIME_HOSTED
+static EvaGcFunctions gc;
+
+void eva_runtime_init(const EvaGcFunctions* functions) {
+    gc = *functions;
+}
+
+#define GC_malloc gc.malloc
+#define GC_malloc_atomic gc.mallocAtomic
+#define GC_malloc_uncollectable gc.mallocUncollectable
+#define GC_free gc.free
+#else
+void* GC_malloc(size_t size);
+void* GC_malloc_atomic(size_t size);
+void* GC_malloc_uncollectable(size_t size);
+void  GC_free(void* ptr);
+#endif
+
+/**
+ * Default chunk size, the larger allocations get a chunk of their own
+ */
+#define EVA_CHUNK_SIZE (64 * 1024)
+
+#define EVA_ALIGN 16
+
+#define EVA_ALIGN_UP(size) (((size) + EVA_ALIGN - 1) & ~(size_t)(EVA_ALIGN - 1))
+
+/**
+ * Arena chunk, the memory follows the header
+ */
+typedef struct Chunk {
+    struct Chunk* prev;
+    char*         limit;
+} Chunk;
+
+/**
+ * Arena of a thread, the regions are nested marks in it
+ */
+typedef struct Arena {
+    Chunk* chunk;
+    char*  cursor;
+    size_t depth;
+} Arena;
+
+static _Thread_local Arena arena;
+
+#define EVA_CHUNK_HEADER EVA_ALIGN_UP(sizeof(Chunk))
+
+static char* chunkStart(Chunk* chunk) {
+    return (char*)chunk + EVA_CHUNK_HEADER;
+}
+
+static void newChunk(size_t size) {
+    if (size < EVA_CHUNK_SIZE - EVA_CHUNK_HEADER) {
+        size = EVA_CHUNK_SIZE - EVA_CHUNK_HEADER;
+    }
+    Chunk* chunk = GC_malloc_uncollectable(EVA_CHUNK_HEADER + size);
+    chunk->prev = arena.chunk;
+    chunk->limit = chunkStart(chunk) + size;
+    arena.chunk = chunk;
+    arena.cursor = chunkStart(chunk);
+}
+
+void* eva_region_enter(void) {
+    if (arena.chunk == NULL) {
+        newChunk(0);
+    }
+    arena.depth++;
+    return arena.cursor;
+}
+
+void eva_region_exit(void* mark) {
+    // free the chunks added since the mark, the first one is kept
+    char* m = mark;
+    while (arena.chunk->prev != NULL &&
+           !(chunkStart(arena.chunk) <= m && m <= arena.chunk->limit)) {
+        Chunk* prev = arena.chunk->prev;
+        GC_free(arena.chunk);
+        arena.chunk = prev;
+    }
+    arena.cursor = m;
+    arena.depth--;
+}
+
+void* eva_region_alloc(size_t size) {
+    size = EVA_ALIGN_UP(size);
+    if ((size_t)(arena.chunk->limit - arena.cursor) < size) {
+        newChunk(size);
+    }
+    void* ptr = arena.cursor;
+    arena.cursor += size;
+    // the memory is reused by the next regions
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void* eva_alloc(size_t size) {
+    if (arena.depth > 0) {
+        return eva_region_alloc(size);
+    }
+    return GC_malloc(size);
+}
+
+/**
+ * Capacity of the new arrays, they're usually filled with push
+ */
+#define EVA_ARRAY_MIN_CAPACITY 8
+
+static void*
+allocArrayData(int64_t capacity, int64_t elementSize, int pointers) {
+    const size_t size = (size_t)(capacity * elementSize);
+    return pointers ? GC_malloc(size) : GC_malloc_atomic(size);
+}
+
+EvaArray* eva_array_new(int64_t size, int64_t elementSize, int pointers) {
+    if (size < 0) {
+        eva_array_bounds_fail(size, 0);
+    }
+    EvaArray* array = GC_malloc(sizeof(EvaArray));
+    array->size = size;
+    array->capacity = size < EVA_ARRAY_MIN_CAPACITY ? EVA_ARRAY_MIN_CAPACITY
+                                                    : size;
+    array->data = allocArrayData(array->capacity, elementSize, pointers);
+    // the atomic memory isn't cleared
+    memset(array->data, 0, (size_t)(size * elementSize));
+    return array;
+}
+
+void eva_array_grow(EvaArray* array, int64_t elementSize, int pointers) {
+    const int64_t capacity = array->capacity * 2;
+    void*         data = allocArrayData(capacity, elementSize, pointers);
+    memcpy(data, array->data, (size_t)(array->size * elementSize));
+    array->data = data;
+    array->capacity = capacity;
+}
+
+void eva_array_bounds_fail(int64_t index, int64_t size) {
+    fflush(stdout);
+    fprintf(
+        stderr,
+        "Index %lld is out of the array bounds [0, %lld)\n",
+        (long long)index,
+        (long long)size);
+    abort();
+}
@@ -0,0 +1,82 @@
+#ifndef EvaRuntime_h
+#define EvaRuntime_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Runtime library of the compiled programs, it's linked into the executables
+ * and registered in the JIT.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Enter a region, returns the mark to release its allocations with
+ */
+void* eva_region_enter(void);
+
+/**
+ * Exit the region, everything allocated since the mark is released at once
+ */
+void eva_region_exit(void* mark);
+
+/**
+ * Bump-allocate zeroed memory in the current region
+ */
+void* eva_region_alloc(size_t size);
+
+/**
+ * Allocate in the current region if there is one, on the GC heap otherwise
+ */
+void* eva_alloc(size_t size);
+
+/**
+ * Dynamic array, the elements are contiguous in the data buffer. The compiled
+ * code indexes and appends inline, the runtime only allocates.
+ */
+typedef struct EvaArray {
+    int64_t size;
+    int64_t capacity;
+    void*   data;
+} EvaArray;
+
+/**
+ * Allocate an array of size zeroed elements on the GC heap, the buffer is
+ * scanned for pointers only if the elements are pointers
+ */
+EvaArray* eva_array_new(int64_t size, int64_t elementSize, int pointers);
+
+/**
+ * Double the capacity of the array, the elements are moved to a new buffer
+ */
+void eva_array_grow(EvaArray* array, int64_t elementSize, int pointers);
+
+/**
+ * Report the index out of the bounds of the array and abort
+ */
+__attribute__((noreturn)) void
+eva_array_bounds_fail(int64_t index, int64_t size);
+
+#ifdef EVA_RUNTIME_HOSTED
+/**
+ * libgc functions of the runtime linked into the compiler, libgc is loaded
+ * only when the JIT starts
+ */
+typedef struct EvaGcFunctions {
+    void* (*malloc)(size_t size);
+    void* (*mallocAtomic)(size_t size);
+    void* (*mallocUncollectable)(size_t size);
+    void (*free)(void* ptr);
+} EvaGcFunctions;
+
+void eva_runtime_init(const EvaGcFunctions* functions);
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // EvaRuntime_h